@@ -0,0 +1,36 @@
+#!/bin/sh
+# Compare switch, direct threaded and call threaded dispatch of ul.
+#
+# usage: bench/dispatch.sh [bytes of output per program] [runs]
+#
+# The programs run are those of t/ that never terminate, so each run is cut
+# off once it has written the given number of bytes; the others halt within
+# a few ms and would tell nothing. The best of the runs is reported.
+set -e
+cd "$(dirname "$0")/.."
+bytes=${1:-10000000}
+runs=${2:-3}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+for mode in SWITCH_DISPATCH DIRECT_THREADING CALL_THREADING; do
+    ${CC:-cc} -std=gnu99 -O2 -DNDEBUG -D$mode -o "$tmp/ul_$mode" ul.c ul_parse.c dynbuf.c
+done
+
+printf '%-20s %-12s %10s\n' dispatch program best_ms
+for prog in t/fib.ul t/hello.ul t/callcc.ul; do
+    for mode in SWITCH_DISPATCH DIRECT_THREADING CALL_THREADING; do
+        best=
+        i=0
+        while [ $i -lt "$runs" ]; do
+            start=$(date +%s%N)
+            "$tmp/ul_$mode" "$prog" | head -c "$bytes" > /dev/null
+            ms=$(( ($(date +%s%N) - start) / 1000000 ))
+            if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+                best=$ms
+            fi
+            i=$((i + 1))
+        done
+        printf '%-20s %-12s %10s\n' "$mode" "$(basename "$prog")" "$best"
+    done
+done
@@ -0,0 +1,67 @@
+/* Runs a command with its output thrown away, for bench/run.sh. Prints its
+ * exit status (128 plus the signal if one killed it), the wall time in ms
+ * and the peak resident set in KB.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 Zeling Feng
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[]) {
+    struct timespec start, end;
+    struct rusage ru;
+    int status, fd;
+    pid_t pid;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s command [arg...]\n", argv[0]);
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((pid = fork()) < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (!pid) {
+        if ((fd = open("/dev/null", O_WRONLY)) < 0 || dup2(fd, 1) < 0) {
+            perror("/dev/null");
+            _exit(127);
+        }
+        execvp(argv[1], argv + 1);
+        perror(argv[1]);
+        _exit(127);
+    }
+    if (wait4(pid, &status, 0, &ru) < 0) {
+        perror("wait4");
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%d %.3f %ld\n", WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status),
+           (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6, ru.ru_maxrss);
+    return 0;
+}
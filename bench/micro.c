@@ -0,0 +1,462 @@
+/* Microbenchmarks of the building blocks of the front end: the parser, the
+ * symbol table, dynbuf and list.h.
+ *
+ * usage: bench/micro [-j] [-t seconds] [benchmark...]
+ *
+ * Every benchmark runs at sizes growing by a constant factor, so a line of
+ * output per size traces how it scales: the time per operation, per byte
+ * of program text for the parser, in ns and in cycles of the time stamp
+ * counter (0 where there is none), and for the parser the MB of program
+ * text parsed per second. Each size is run three times and the fastest
+ * kept. A benchmark stops growing once the next size looks to take longer
+ * than -t seconds, 10 by default, so an algorithm gone quadratic shows up
+ * as a curve cut short rather than a run that never ends. -j writes the results as a JSON array instead, an object per line.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 Zeling Feng
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dynbuf.h"
+#include "list.h"
+#include "ul_parse.h"
+#include "ul_symtab.h"
+
+typedef struct {
+    const char *name;
+    size_t first, last, factor;
+    /* make the input for size n, time run on it and count its operations */
+    void *(*setup)(size_t n);
+    void (*run)(void *arg);
+    size_t (*ops)(void *arg);
+    size_t (*bytes)(void *arg); /* of program text, for MB/s, or NULL */
+    void (*teardown)(void *arg);
+} micro_t;
+
+static void micro_oom(void) {
+    fputs("micro: out of memory\n", stderr);
+    exit(1);
+}
+
+static void *micro_alloc(size_t size) {
+    void *p = malloc(size);
+    if (!p) {
+        micro_oom();
+    }
+    return p;
+}
+
+static uint64_t micro_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static double micro_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Used by the benchmarks so the compiler keeps what they compute. */
+static volatile size_t micro_sink;
+
+/* Parsing. A program of n applications, shaped as a balanced tree, as a
+ * left spine ```...`ii...i, or as a right spine `i`i...`ii. */
+typedef struct {
+    char *text;
+    size_t len;
+} micro_text_t;
+
+static char *micro_tree(char *p, size_t n) {
+    static const char atoms[] = "skiv";
+    size_t left = n / 2;
+
+    if (!n) {
+        *p = atoms[(uintptr_t) p % 4];
+        return p + 1;
+    }
+    *p++ = '`';
+    p = micro_tree(p, left);
+    return micro_tree(p, n - 1 - left);
+}
+
+static micro_text_t *micro_text(size_t n, int shape) {
+    micro_text_t *t = micro_alloc(sizeof(*t));
+    char *p;
+
+    p = t->text = micro_alloc(2 * n + 2);
+    switch (shape) {
+    case 0:
+        p = micro_tree(p, n);
+        break;
+    case 1:
+        memset(p, '`', n);
+        memset(p + n, 'i', n + 1);
+        p += 2 * n + 1;
+        break;
+    case 2:
+        for (size_t i = 0; i < n; i++) {
+            *p++ = '`';
+            *p++ = 'i';
+        }
+        *p++ = 'i';
+        break;
+    }
+    *p = '\0';
+    t->len = p - t->text;
+    return t;
+}
+
+static void *micro_parse_tree_setup(size_t n) {
+    return micro_text(n, 0);
+}
+
+static void *micro_parse_left_setup(size_t n) {
+    return micro_text(n, 1);
+}
+
+static void *micro_parse_right_setup(size_t n) {
+    return micro_text(n, 2);
+}
+
+static void micro_parse_run(void *arg) {
+    micro_text_t *t = arg;
+    ul_parse_state_t state = { t->text, UL_PARSE_OK, NULL };
+    ul_ast_t *ast = ul_parse_prog(&state);
+
+    if (!ast) {
+        fprintf(stderr, "micro: parse error %d\n", state.error);
+        exit(1);
+    }
+    ul_ast_free(ast);
+}
+
+static size_t micro_text_len(void *arg) {
+    return ((micro_text_t *) arg)->len;
+}
+
+static void micro_text_free(void *arg) {
+    free(((micro_text_t *) arg)->text);
+    free(arg);
+}
+
+/* The symbol table: n distinct names looked up in an empty table, each a
+ * miss and so an insertion, or in the table already holding them all, each
+ * a hit. */
+#define MICRO_SYM 24
+
+typedef struct {
+    size_t n;
+    char (*names)[MICRO_SYM];
+    ul_symtab_t tbl;
+    int filled;
+} micro_syms_t;
+
+static micro_syms_t *micro_syms(size_t n) {
+    micro_syms_t *s = micro_alloc(sizeof(*s));
+
+    s->n = n;
+    s->names = micro_alloc(n * MICRO_SYM);
+    for (size_t i = 0; i < n; i++) {
+        snprintf(s->names[i], MICRO_SYM, "sym%zu", i);
+    }
+    ul_symtab_init(&s->tbl);
+    s->filled = 0;
+    return s;
+}
+
+static void micro_syms_fill(micro_syms_t *s) {
+    for (size_t i = 0; i < s->n; i++) {
+        if (!ul_symtab_get(&s->tbl, UL_SYM_S, s->names[i], strlen(s->names[i]))) {
+            micro_oom();
+        }
+    }
+    s->filled = 1;
+}
+
+static void *micro_symtab_miss_setup(size_t n) {
+    return micro_syms(n);
+}
+
+/* Every run after the first starts over from an empty table. */
+static void micro_symtab_miss_run(void *arg) {
+    micro_syms_t *s = arg;
+
+    if (s->filled) {
+        ul_symtab_destroy(&s->tbl);
+        ul_symtab_init(&s->tbl);
+    }
+    micro_syms_fill(s);
+}
+
+static void *micro_symtab_hit_setup(size_t n) {
+    micro_syms_t *s = micro_syms(n);
+    micro_syms_fill(s);
+    return s;
+}
+
+static void micro_symtab_hit_run(void *arg) {
+    micro_syms_t *s = arg;
+    size_t sum = 0;
+
+    for (size_t i = 0; i < s->n; i++) {
+        sum += (size_t) ul_symtab_get(&s->tbl, UL_SYM_S, s->names[i], strlen(s->names[i]));
+    }
+    micro_sink = sum;
+}
+
+static size_t micro_syms_n(void *arg) {
+    return ((micro_syms_t *) arg)->n;
+}
+
+static void micro_syms_free(void *arg) {
+    micro_syms_t *s = arg;
+
+    ul_symtab_destroy(&s->tbl);
+    free(s->names);
+    free(s);
+}
+
+/* dynbuf: n values pushed onto an empty buffer, then popped off it. */
+typedef struct {
+    size_t n;
+} micro_n_t;
+
+static void *micro_n_setup(size_t n) {
+    micro_n_t *m = micro_alloc(sizeof(*m));
+    m->n = n;
+    return m;
+}
+
+static size_t micro_n(void *arg) {
+    return 2 * ((micro_n_t *) arg)->n;
+}
+
+#define MICRO_DYNBUF(type)                                                  \
+    static void micro_dynbuf_##type##_run(void *arg) {                      \
+        size_t n = ((micro_n_t *) arg)->n, sum = 0;                         \
+        dynbuf_t buf;                                                       \
+                                                                            \
+        dynbuf_init(&buf);                                                  \
+        for (size_t i = 0; i < n; i++) {                                    \
+            if (dynbuf_put_##type(&buf, (type) i) < 0) {                    \
+                micro_oom();                                                \
+            }                                                               \
+        }                                                                   \
+        for (size_t i = 0; i < n; i++) {                                    \
+            sum += dynbuf_pop_##type(&buf);                                 \
+        }                                                                   \
+        dynbuf_free(&buf);                                                  \
+        micro_sink = sum;                                                   \
+    }
+
+MICRO_DYNBUF(uint8_t)
+MICRO_DYNBUF(uint64_t)
+
+/* list.h: a walk over a list of n nodes, linked in the order they lie in
+ * memory or shuffled so that nearly every step misses the cache. */
+typedef struct {
+    size_t value;
+    list_link_t link;
+} micro_node_t;
+
+typedef struct {
+    size_t n;
+    micro_node_t *nodes;
+    list_t list;
+} micro_list_t;
+
+static micro_list_t *micro_list(size_t n, int shuffle) {
+    micro_list_t *l = micro_alloc(sizeof(*l));
+    size_t *order = micro_alloc(n * sizeof(*order)), j, t;
+
+    l->n = n;
+    l->nodes = micro_alloc(n * sizeof(*l->nodes));
+    list_init(&l->list);
+    for (size_t i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    for (size_t i = n - 1; shuffle && i > 0; i--) {
+        j = (size_t) random() % (i + 1);
+        t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+    for (size_t i = 0; i < n; i++) {
+        l->nodes[order[i]].value = i;
+        list_insert_back(&l->list, &l->nodes[order[i]].link);
+    }
+    free(order);
+    return l;
+}
+
+static void *micro_list_seq_setup(size_t n) {
+    return micro_list(n, 0);
+}
+
+static void *micro_list_shuffled_setup(size_t n) {
+    return micro_list(n, 1);
+}
+
+static void micro_list_run(void *arg) {
+    micro_list_t *l = arg;
+    size_t sum = 0;
+
+    LIST_FOR_EACH(&l->list, node, micro_node_t, link) {
+        sum += node->value;
+    }
+    micro_sink = sum;
+}
+
+static size_t micro_list_n(void *arg) {
+    return ((micro_list_t *) arg)->n;
+}
+
+static void micro_list_free(void *arg) {
+    free(((micro_list_t *) arg)->nodes);
+    free(arg);
+}
+
+static const micro_t micros[] = {
+    { "parse_tree", 1 << 10, 1 << 24, 4, micro_parse_tree_setup, micro_parse_run, micro_text_len, micro_text_len, micro_text_free },
+    { "parse_left", 1 << 10, 1 << 24, 4, micro_parse_left_setup, micro_parse_run, micro_text_len, micro_text_len, micro_text_free },
+    /* the parser recurses into the operand, so a right spine much deeper
+     * than this runs out of stack */
+    { "parse_right", 1 << 10, 1 << 16, 4, micro_parse_right_setup, micro_parse_run, micro_text_len, micro_text_len, micro_text_free },
+    { "symtab_miss", 1000, 10000000, 10, micro_symtab_miss_setup, micro_symtab_miss_run, micro_syms_n, NULL, micro_syms_free },
+    { "symtab_hit", 1000, 10000000, 10, micro_symtab_hit_setup, micro_symtab_hit_run, micro_syms_n, NULL, micro_syms_free },
+    { "dynbuf_u8", 1000, 10000000, 10, micro_n_setup, micro_dynbuf_uint8_t_run, micro_n, NULL, free },
+    { "dynbuf_u64", 1000, 10000000, 10, micro_n_setup, micro_dynbuf_uint64_t_run, micro_n, NULL, free },
+    { "list_seq", 1000, 10000000, 10, micro_list_seq_setup, micro_list_run, micro_list_n, NULL, micro_list_free },
+    { "list_shuffled", 1000, 10000000, 10, micro_list_shuffled_setup, micro_list_run, micro_list_n, NULL, micro_list_free },
+};
+
+#define MICRO_RUNS 3
+
+static void micro_bench(const micro_t *m, double budget, int json, int *first) {
+    double secs = 0, best, start, t;
+    uint64_t ticks = 0, best_ticks, t0;
+    size_t ops;
+    void *arg;
+
+    for (size_t n = m->first; n <= m->last; n *= m->factor) {
+        /* what the last size took, scaled linearly */
+        if (secs * m->factor > budget) {
+            fprintf(stderr, "%s: stopped short of %zu, %zu took %.3f s\n", m->name, n, n / m->factor, secs);
+            break;
+        }
+        arg = m->setup(n);
+        best = 0;
+        best_ticks = 0;
+        for (int i = 0; i < MICRO_RUNS && (!i || secs * MICRO_RUNS < budget); i++) {
+            start = micro_now();
+            t0 = micro_ticks();
+            m->run(arg);
+            ticks = micro_ticks() - t0;
+            t = micro_now() - start;
+            if (!i || t < best) {
+                best = t;
+                best_ticks = ticks;
+            }
+            secs = t;
+        }
+        secs = best;
+        ops = m->ops(arg);
+        if (json) {
+            printf("%s{\"benchmark\": \"%s\", \"n\": %zu, \"ns_per_op\": %.3f, \"cycles_per_op\": %.3f",
+                   *first ? "[\n" : ",\n", m->name, n, best * 1e9 / ops, (double) best_ticks / ops);
+            if (m->bytes) {
+                printf(", \"mb_per_s\": %.3f", m->bytes(arg) / best / 1e6);
+            }
+            printf("}");
+        } else {
+            if (*first) {
+                printf("%-14s %10s %10s %10s %10s\n", "benchmark", "n", "ns/op", "cycles/op", "MB/s");
+            }
+            printf("%-14s %10zu %10.3f %10.3f", m->name, n, best * 1e9 / ops, (double) best_ticks / ops);
+            if (m->bytes) {
+                printf(" %10.3f", m->bytes(arg) / best / 1e6);
+            }
+            printf("\n");
+        }
+        fflush(stdout);
+        *first = 0;
+        m->teardown(arg);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    double budget = 10;
+    int json = 0, first = 1, opt, found;
+
+    while ((opt = getopt(argc, argv, "jt:")) != -1) {
+        switch (opt) {
+        case 'j':
+            json = 1;
+            break;
+        case 't':
+            if ((budget = atof(optarg)) <= 0) {
+                goto usage;
+            }
+            break;
+        default:
+            goto usage;
+        }
+    }
+    for (int i = optind; i < argc; i++) {
+        found = 0;
+        for (size_t j = 0; j < sizeof(micros) / sizeof(micros[0]); j++) {
+            found |= !strcmp(argv[i], micros[j].name);
+        }
+        if (!found) {
+            fprintf(stderr, "micro: no benchmark %s\n", argv[i]);
+            goto usage;
+        }
+    }
+    for (size_t j = 0; j < sizeof(micros) / sizeof(micros[0]); j++) {
+        found = optind == argc;
+        for (int i = optind; i < argc; i++) {
+            found |= !strcmp(argv[i], micros[j].name);
+        }
+        if (found) {
+            micro_bench(&micros[j], budget, json, &first);
+        }
+    }
+    if (json) {
+        printf(first ? "[]\n" : "\n]\n");
+    }
+    return 0;
+usage:
+    fprintf(stderr, "usage: %s [-j] [-t seconds] [benchmark...]\n", argv[0]);
+    return 1;
+}
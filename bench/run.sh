@@ -0,0 +1,155 @@
+#!/bin/sh
+# End-to-end benchmarks of the ul VM and the ul_rt runtime.
+#
+# usage: bench/run.sh [-n runs] [-o results.json] [backend...]
+#        bench/run.sh -d old.json new.json
+#
+# Every program of the corpus below is run on every backend, ul and ul_rt
+# unless some are named, and the best of the runs is reported as a JSON
+# array with an object per program and backend: its exit status, the
+# reductions it made, its wall time and the reductions per second that
+# comes to, its peak resident set and, for ul, the percentiles of its
+# collection pauses. The reductions are counted once by a build with
+# -DUL_STATS, so that the builds timed have no counters in them. A backend
+# that fails on a program, as ul_rt does once its heap is too small, is
+# still reported with the status it exited with.
+#
+# -d compares two result files, printing the change in the time and peak
+# resident set of every run found in both.
+set -e
+cd "$(dirname "$0")/.."
+
+if [ "$1" = -d ]; then
+    [ $# -eq 3 ] || { echo "usage: $0 -d old.json new.json" >&2; exit 1; }
+    exec awk '
+function get(s, k) {
+    if (!match(s, "\"" k "\": [^,}]*")) {
+        return ""
+    }
+    s = substr(s, RSTART + length(k) + 4, RLENGTH - length(k) - 4)
+    gsub(/"/, "", s)
+    return s
+}
+function change(a, b) {
+    return a > 0 && b != "" && b != "null" ? sprintf("%+.1f%%", (b - a) * 100 / a) : "-"
+}
+BEGIN {
+    printf "%-8s %-14s %10s %10s %8s %9s %9s %8s\n", "backend", "program", "old_ms", "new_ms", "time", "old_kb", "new_kb", "rss"
+}
+/"backend"/ {
+    key = get($0, "backend") " " get($0, "program")
+    if (FILENAME == ARGV[1]) {
+        old[key] = $0
+        next
+    }
+    if (!(key in old)) {
+        next
+    }
+    split(key, k, " ")
+    ot = get(old[key], "wall_ms"); nt = get($0, "wall_ms")
+    or = get(old[key], "peak_rss_kb"); nr = get($0, "peak_rss_kb")
+    printf "%-8s %-14s %10s %10s %8s %9s %9s %8s", k[1], k[2], ot, nt, change(ot, nt), or, nr, change(or, nr)
+    if (get(old[key], "exit") != get($0, "exit")) {
+        printf "  exit %s -> %s", get(old[key], "exit"), get($0, "exit")
+    }
+    printf "\n"
+}' "$2" "$3"
+fi
+
+runs=3
+out=
+while getopts n:o: opt; do
+    case $opt in
+    n) runs=$OPTARG ;;
+    o) out=$OPTARG ;;
+    *) echo "usage: $0 [-n runs] [-o results.json] [backend...]" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+backends=${*:-ul ul_rt}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+CC=${CC:-cc}
+for b in $backends; do
+    case $b in
+    ul) src="ul.c ul_parse.c dynbuf.c" ;;
+    ul_rt) src="ul_rt.c ul_parse.c dynbuf.c" ;;
+    *) echo "$0: no backend $b" >&2; exit 1 ;;
+    esac
+    $CC -std=gnu99 -O2 -DNDEBUG -DDIRECT_THREADING -o "$tmp/$b" $src -pthread
+    $CC -std=gnu99 -O2 -DNDEBUG -DDIRECT_THREADING -DUL_STATS -o "$tmp/${b}_stats" $src -pthread
+done
+$CC -O2 -o "$tmp/measure" bench/measure.c
+
+# a large program for the parser and the compiler, which prints x
+awk 'BEGIN {
+    for (i = 0; i < 1000000; i++) printf "`"
+    printf ".x"
+    for (i = 0; i < 1000000; i++) printf "i"
+    print ""
+}' > "$tmp/parse_1m.ul"
+
+# name, file and the reductions it is cut off at, 0 for none: Church
+# numerals printing m^n stars, hello, world! printed 10^5 times, recursion
+# 2^n deep, a live set growing to 2^18 closures, c taken 2^16 times, and
+# the programs of t/, which never halt
+cat > "$tmp/corpus" <<EOF
+church_2e10 bench/progs/church_2e10.ul 0
+church_2e16 bench/progs/church_2e16.ul 0
+church_3e12 bench/progs/church_3e12.ul 0
+church_2e20 bench/progs/church_2e20.ul 0
+hello_1e5 bench/progs/hello_1e5.ul 0
+fib t/fib.ul 20000000
+hello t/hello.ul 20000000
+deep_2e14 bench/progs/deep_2e14.ul 0
+deep_2e16 bench/progs/deep_2e16.ul 0
+gc_2e18 bench/progs/gc_2e18.ul 0
+cc_2e16 bench/progs/cc_2e16.ul 0
+callcc t/callcc.ul 5000000
+parse_1m $tmp/parse_1m.ul 0
+EOF
+
+while read -r name file fuel; do
+    for b in $backends; do
+        fuel_opt=
+        if [ "$fuel" -gt 0 ]; then
+            fuel_opt="-f $fuel"
+        fi
+        verbose=
+        if [ "$b" = ul ]; then
+            verbose=-v
+        fi
+        red=$("$tmp/${b}_stats" --stats=json $fuel_opt "$file" 2>&1 >/dev/null </dev/null |
+              grep -o '"reductions": [0-9]*' | head -n 1 | cut -d ' ' -f 2)
+        best=
+        i=0
+        while [ $i -lt "$runs" ]; do
+            set -- $("$tmp/measure" "$tmp/$b" $verbose $fuel_opt "$file" 2>"$tmp/err" </dev/null)
+            if [ -z "$best" ] || awk -v a="$2" -v b="$best" 'BEGIN { exit !(a < b) }'; then
+                status=$1 best=$2 rss=$3
+                cp "$tmp/err" "$tmp/best_err"
+            fi
+            i=$((i + 1))
+        done
+        pauses=$(sed -n 's/^gc: p50 \([^ ]*\) p90 \([^ ]*\) p99 \([^ ]*\) p99\.9 \([^ ]*\) max \([^ ]*\) ms$/{"p50": \1, "p90": \2, "p99": \3, "p99.9": \4, "max": \5}/p' "$tmp/best_err")
+        rps=null
+        if [ -n "$red" ]; then
+            rps=$(awk -v r="$red" -v ms="$best" 'BEGIN { printf "%.0f", (ms > 0 ? r * 1000 / ms : 0) }')
+        fi
+        printf '%-8s %-14s %10s ms %12s reductions/s %8s KB exit %s\n' "$b" "$name" "$best" "$rps" "$rss" "$status" >&2
+        printf '{"backend": "%s", "program": "%s", "exit": %s, "reductions": %s, "wall_ms": %s, "reductions_per_sec": %s, "peak_rss_kb": %s, "gc_pause_ms": %s}\n' \
+            "$b" "$name" "$status" "${red:-null}" "$best" "$rps" "$rss" "${pauses:-null}" >> "$tmp/results"
+    done
+done < "$tmp/corpus"
+
+{
+    echo '['
+    sed '$!s/$/,/' "$tmp/results"
+    echo ']'
+} > "$tmp/json"
+if [ -n "$out" ]; then
+    cp "$tmp/json" "$out"
+else
+    cat "$tmp/json"
+fi
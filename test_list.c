@@ -35,7 +35,7 @@ int main()
 {
     list_t l;
     list_init(&l);
-    struct dummy *unlink1, *unlink2;
+    struct dummy *unlink1 = NULL, *unlink2 = NULL;
     for (int i = 0; i < 10; i++) {
         struct dummy *obj1 = malloc(sizeof(struct dummy));
         struct dummy *obj2 = malloc(sizeof(struct dummy));
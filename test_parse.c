@@ -31,14 +31,31 @@
 #include "ul_parse.h"
 
 static void run_test_case(const char *filename);
+static void test_offsets(void);
 
 int main()
 {
     run_test_case("t/fib.ul");
     run_test_case("t/hello.ul");
+    test_offsets();
     puts("ok.");
 }
 
+static void test_offsets(void)
+{
+    char buf[] = "  ``s .a`k i";
+    ul_parse_state_t state = {buf, UL_PARSE_OK};
+    ul_ast_t *ast = ul_parse_prog(&state);
+    assert(ast && ast->nrands == 2);
+    assert(ast->off == 2);
+    assert(ast->u.rator->off == 4);
+    assert(ast->rands[0]->off == 6);
+    assert(ast->rands[1]->off == 8);
+    assert(ast->rands[1]->u.rator->off == 9);
+    assert(ast->rands[1]->rands[0]->off == 11);
+    ul_ast_free(ast);
+}
+
 void run_test_case(const char *filename)
 {
     char buf[1024];
@@ -0,0 +1,67 @@
+/* Test for the CPS runtime.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2020 Zeling Feng
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+
+static void run_test_case(const char *args, const char *expected, int status);
+
+int main()
+{
+    char stars[514];
+
+    /* Both loops capture a continuation per iteration and go through
+     * several collections before the outer continuation or promise is
+     * used. */
+    memset(stars, '*', 512);
+    strcpy(stars + 512, "!");
+    run_test_case("t/callcc_gc.ul", stars, 0);
+    run_test_case("t/promise_gc.ul", stars, 0);
+    run_test_case("-f 50000 t/callcc_gc.ul", stars, 0);
+    /* stopped in the middle of the loop */
+    run_test_case("-f 1000 t/callcc_gc.ul", NULL, 2);
+    run_test_case("-f 10000 t/callcc.ul", NULL, 2);
+    /* several programs taking turns on two workers; one running out of fuel
+     * does not stop the others */
+    run_test_case("-j 2 t/callcc_gc.ul t/promise_gc.ul t/callcc_gc.ul", NULL, 0);
+    run_test_case("-j 2 -f 50000 t/callcc.ul t/promise_gc.ul t/callcc_gc.ul", NULL, 2);
+    puts("ok.");
+}
+
+void run_test_case(const char *args, const char *expected, int status)
+{
+    char cmd[256], buf[8192];
+    size_t n;
+    int rc;
+    snprintf(cmd, sizeof(cmd), "./ul_rt %s 2>/dev/null", args);
+    FILE *out = popen(cmd, "r");
+    assert(out);
+    n = fread(buf, 1, sizeof(buf) - 1, out);
+    buf[n] = '\0';
+    rc = pclose(out);
+    assert(WIFEXITED(rc) && WEXITSTATUS(rc) == status);
+    assert(!expected || !strcmp(buf, expected));
+}
@@ -0,0 +1,82 @@
+/* Test for the ul server.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2020 Zeling Feng
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static void run_test_case(const char *args, const char *expected, int status);
+
+static char sock[64];
+
+int main()
+{
+    char stars[3 * 513 + 1];
+    pid_t server;
+
+    snprintf(sock, sizeof(sock), "/tmp/test_serve.%d", (int) getpid());
+    if (!(server = fork())) {
+        execl("./ul", "ul", "-s", sock, "-j", "2", (char *) NULL);
+        _exit(127);
+    }
+    for (int i = 0; i < 100 && access(sock, F_OK); i++) {
+        usleep(10000);
+    }
+    memset(stars, '*', 512);
+    strcpy(stars + 512, "!");
+    run_test_case("-v -n 1 %s t/callcc_gc.ul", stars, 0);
+    /* the contexts of the earlier runs are reused */
+    memcpy(stars + 513, stars, 513);
+    memcpy(stars + 2 * 513, stars, 513);
+    stars[3 * 513] = '\0';
+    run_test_case("-v -n 3 %s t/callcc_gc.ul", stars, 0);
+    run_test_case("-c 4 -n 100 %s t/promise_gc.ul", NULL, 0);
+    /* out of fuel, then halting on the same contexts */
+    run_test_case("-n 4 -f 1000 %s t/callcc_gc.ul", NULL, 1);
+    run_test_case("-c 2 -n 20 %s t/callcc_gc.ul", NULL, 0);
+    run_test_case("-n 2 -f 100000 %s t/hello.ul", NULL, 1);
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    unlink(sock);
+    puts("ok.");
+}
+
+void run_test_case(const char *args, const char *expected, int status)
+{
+    char fmt[256], cmd[256], buf[8192];
+    size_t n;
+    int rc;
+    snprintf(fmt, sizeof(fmt), "./ul_load %s 2>/dev/null", args);
+    snprintf(cmd, sizeof(cmd), fmt, sock);
+    FILE *out = popen(cmd, "r");
+    assert(out);
+    n = fread(buf, 1, sizeof(buf) - 1, out);
+    buf[n] = '\0';
+    rc = pclose(out);
+    assert(WIFEXITED(rc) && WEXITSTATUS(rc) == status);
+    assert(!expected || !strcmp(buf, expected));
+}
@@ -42,6 +42,27 @@ int main()
         assert(strcmp(test_data[i], sym->data) == 0);
     }
     assert(symtab.nelems == 3);
+    /* a prefix is a symbol of its own */
+    ul_sym_t *sym = ul_symtab_get(&symtab, UL_SYM_S, "Testing", 2);
+    assert(strcmp(sym->data, "Te") == 0);
+    assert(symtab.nelems == 4);
+    ul_symtab_destroy(&symtab);
+
+    /* enough symbols for the table to grow many times over */
+    static ul_sym_t *syms[100000];
+    char name[16];
+    ul_symtab_init(&symtab);
+    for (int i = 0; i < sizeof(syms) / sizeof(syms[0]); i++) {
+        snprintf(name, sizeof(name), "sym%d", i);
+        syms[i] = ul_symtab_get(&symtab, UL_SYM_K, name, strlen(name));
+        assert(syms[i] && strcmp(syms[i]->data, name) == 0);
+    }
+    for (int i = 0; i < sizeof(syms) / sizeof(syms[0]); i++) {
+        snprintf(name, sizeof(name), "sym%d", i);
+        assert(ul_symtab_get(&symtab, UL_SYM_S, name, strlen(name)) == syms[i]);
+        assert(syms[i]->kind == UL_SYM_K);
+    }
+    assert(symtab.nelems == sizeof(syms) / sizeof(syms[0]));
     ul_symtab_destroy(&symtab);
     puts("ok.");
 }
@@ -0,0 +1,265 @@
+/* Test for the ul VM.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 Zeling Feng
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static char *run(const char *args, int status);
+static void run_checkpoints(const char *prog, long fuel, int n);
+static void run_image(const char *prog);
+static void run_same(const char *opts, const char *prog);
+static void run_inputs(const char *prog, long warm);
+static void run_overflow(const char *prog, long stack_max);
+
+/* The start of ul_image_hdr_t in ul.c. */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_ops;
+    uint64_t base;
+    uint64_t size;
+    uint64_t n_ics;
+    uint64_t code_size;
+    uint64_t const_off;
+    uint64_t const_size;
+    uint64_t reloc_off;
+    uint64_t n_relocs;
+} image_hdr_t;
+
+static char tmp[64];
+
+int main()
+{
+    snprintf(tmp, sizeof(tmp), "/tmp/test_ul.%d", (int) getpid());
+    /* continuations captured before the checkpoint and used after it, a
+     * stack of many segments, and a heap of some MB */
+    run_checkpoints("t/callcc_gc.ul", 2000, 1);
+    run_checkpoints("t/callcc_gc.ul", 1000, 4);
+    run_checkpoints("bench/progs/deep_2e14.ul", 40000, 2);
+    run_checkpoints("bench/progs/gc_2e18.ul", 800000, 1);
+    run_image("t/callcc_gc.ul");
+    run_image("bench/progs/cc_2e16.ul");
+    /* the parallel collector, which only runs with more than one CPU and
+     * once over UL_GC_THREADS_MIN_LIVE survives a collection, as in
+     * gc_2e18 */
+    run_same("-g 4", "bench/progs/gc_2e18.ul");
+    run_same("-g 4", "bench/progs/cc_2e16.ul");
+    run_same("-g 4", "t/callcc_gc.ul");
+    /* the incremental collector, scanning stacks frozen by call/cc too */
+    run_same("-p 200", "bench/progs/gc_2e18.ul");
+    run_same("-p 200", "bench/progs/cc_2e16.ul");
+    run_same("-p 200", "bench/progs/deep_2e14.ul");
+    run_same("-p 200", "t/callcc_gc.ul");
+    /* a stack of many segments, and one that outgrows the most it may */
+    run_same("", "bench/progs/deep_2e16.ul");
+    run_overflow("bench/progs/deep_2e16.ul", 256 * 1024);
+    /* fork mode, with what was printed while warming up replayed */
+    run_inputs("t/callcc_gc.ul", 1000);
+    run_inputs("bench/progs/deep_2e14.ul", 40000);
+    puts("ok.");
+}
+
+/* The output of ./ul run with args, which must exit with status. */
+char *run(const char *args, int status)
+{
+    char cmd[256], *buf = NULL;
+    size_t n = 0, cap = 0;
+    int rc;
+    snprintf(cmd, sizeof(cmd), "./ul %s 2>/dev/null", args);
+    FILE *out = popen(cmd, "r");
+    assert(out);
+    do {
+        if (n == cap) {
+            cap = cap ? 2 * cap : 65536;
+            buf = realloc(buf, cap + 1);
+            assert(buf);
+        }
+        n += fread(buf + n, 1, cap - n, out);
+    } while (n == cap);
+    buf[n] = '\0';
+    rc = pclose(out);
+    assert(WIFEXITED(rc) && WEXITSTATUS(rc) == status);
+    return buf;
+}
+
+/* The contents of the file at path, of *size bytes. */
+static uint8_t *file_read(const char *path, size_t *size)
+{
+    FILE *in = fopen(path, "r");
+    uint8_t *img;
+    assert(in && !fseek(in, 0, SEEK_END));
+    *size = ftell(in);
+    rewind(in);
+    img = malloc(*size);
+    assert(img && fread(img, 1, *size, in) == *size);
+    fclose(in);
+    return img;
+}
+
+static void file_write(const char *path, const uint8_t *img, size_t size)
+{
+    FILE *out = fopen(path, "w");
+    assert(out && fwrite(img, 1, size, out) == size && !fclose(out));
+}
+
+/* Checks that prog run with opts prints what it does without them. */
+void run_same(const char *opts, const char *prog)
+{
+    char args[256], *whole = run(prog, 0), *out;
+
+    snprintf(args, sizeof(args), "%s %s", opts, prog);
+    out = run(args, 0);
+    assert(!strcmp(out, whole));
+    free(out);
+    free(whole);
+}
+
+/* Checks that prog, run with its stack held to stack_max bytes, stops with
+ * the status of a stack overflow rather than crashing, having printed the
+ * start of what it prints when the stack may grow. */
+void run_overflow(const char *prog, long stack_max)
+{
+    char args[256], *whole = run(prog, 0), *out;
+
+    snprintf(args, sizeof(args), "-m %ld %s", stack_max, prog);
+    out = run(args, 1);
+    assert(strlen(out) < strlen(whole) && !strncmp(out, whole, strlen(out)));
+    free(out);
+    free(whole);
+}
+
+/* Runs prog in fork mode on three inputs, warming up for warm applications,
+ * and checks that each child prints what a run straight through does and
+ * that the exit status of each is reported. */
+void run_inputs(const char *prog, long warm)
+{
+    char args[512], in[3][80], line[256], *whole = run(prog, 0), *out, *p;
+    uint8_t *got;
+    size_t size;
+
+    for (int i = 0; i < 3; i++) {
+        snprintf(in[i], sizeof(in[i]), "%s.in%d", tmp, i);
+        file_write(in[i], (uint8_t *) "", 0);
+    }
+    snprintf(args, sizeof(args), "-i -j 2 -w %ld %s %s %s %s", warm, prog, in[0], in[1], in[2]);
+    out = run(args, 0);
+    for (int i = 0; i < 3; i++) {
+        snprintf(line, sizeof(line), "%s 0 ", in[i]);
+        assert((p = strstr(out, line)) && (p == out || p[-1] == '\n'));
+        snprintf(line, sizeof(line), "%s.out", in[i]);
+        got = file_read(line, &size);
+        assert(size == strlen(whole) && !memcmp(got, whole, size));
+        free(got);
+        unlink(line);
+        unlink(in[i]);
+    }
+    assert(strstr(out, "\n3 inputs in "));
+    free(out);
+    free(whole);
+}
+
+/* Compiles prog to an image and checks that running the image prints what
+ * running prog does, whether the image is mapped at the address it was
+ * written for or has to be relocated, and that a broken image is turned
+ * down rather than run. */
+void run_image(const char *prog)
+{
+    char args[256], path[80], *whole = run(prog, 0), *out;
+    image_hdr_t *hdr;
+    uint64_t at, v;
+    uint8_t *img;
+    size_t size;
+
+    snprintf(path, sizeof(path), "%s.img", tmp);
+    snprintf(args, sizeof(args), "-o %s %s", path, prog);
+    free(run(args, 0));
+    out = run(path, 0);
+    assert(!strcmp(out, whole));
+    free(out);
+
+    /* an address no page can be mapped at, so every pointer has to be
+     * relocated */
+    img = file_read(path, &size);
+    hdr = (image_hdr_t *) img;
+    hdr->base += 8;
+    for (uint64_t i = 0; i < hdr->n_relocs; i++) {
+        memcpy(&at, img + hdr->reloc_off + i * sizeof(at), sizeof(at));
+        at &= ~(1ULL << 63);
+        memcpy(&v, img + at, sizeof(v));
+        v += v ? 8 : 0;
+        memcpy(img + at, &v, sizeof(v));
+    }
+    file_write(path, img, size);
+    out = run(path, 0);
+    assert(!strcmp(out, whole));
+    free(out);
+
+    file_write(path, img, size - 8);
+    out = run(path, 1);
+    assert(!*out);
+    free(out);
+    hdr->version++;
+    file_write(path, img, size);
+    out = run(path, 1);
+    assert(!*out);
+    free(out);
+
+    free(img);
+    free(whole);
+    unlink(path);
+}
+
+/* Runs prog fuel applications at a time, checkpointing it n times and
+ * resuming it from each checkpoint, and checks that what the runs print
+ * adds up to what a run straight through does. */
+void run_checkpoints(const char *prog, long fuel, int n)
+{
+    char args[256], from[80], to[80], *whole = run(prog, 0), *part;
+    size_t done = 0;
+
+    snprintf(from, sizeof(from), "%s", prog);
+    for (int i = 0; i <= n; i++) {
+        snprintf(to, sizeof(to), "%s.ck%d", tmp, i);
+        if (i < n) {
+            snprintf(args, sizeof(args), "-f %ld -k %s %s", fuel, to, from);
+        } else {
+            snprintf(args, sizeof(args), "%s", from);
+        }
+        part = run(args, i < n ? 2 : 0);
+        assert(!strncmp(whole + done, part, strlen(part)));
+        done += strlen(part);
+        free(part);
+        if (i) {
+            unlink(from);
+        }
+        strcpy(from, to);
+    }
+    assert(done == strlen(whole));
+    free(whole);
+}
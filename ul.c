@@ -22,97 +22,602 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
  * SOFTWARE.
  */
+#define _GNU_SOURCE /* fopencookie */
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "ul_parse.h"
+#include "ul_serve.h"
+#include "ul_trace.h"
 #include "dynbuf.h"
 
+/* Each semispace starts at UL_HEAP_MIN and grows up to UL_HEAP_SIZE with
+ * what survives collections. From UL_HUGE_PAGE up they are backed with
+ * transparent huge pages. */
+#ifndef UL_HEAP_SIZE
+#define UL_HEAP_SIZE (16 * 1024 * 1024)
+#endif
+#ifndef UL_HEAP_MIN
+#define UL_HEAP_MIN (256 * 1024)
+#endif
+#define UL_HUGE_PAGE (2 * 1024 * 1024)
+/* The stack starts as one UL_STACK_SIZE segment, and every further segment
+ * is twice the size of the one below it, up to UL_STACK_SEG_MAX. */
+#ifndef UL_STACK_SIZE
+#define UL_STACK_SIZE (4 * 1024)
+#endif
+#ifndef UL_STACK_SEG_MAX
+#define UL_STACK_SEG_MAX (1024 * 1024)
+#endif
+/* the most the segments may take in all, unless ul -m says otherwise */
+#ifndef UL_STACK_MAX
+#define UL_STACK_MAX (256 * 1024 * 1024)
+#endif
+/* The number of values copied back at a time from a frozen stack. */
+#ifndef UL_THAW_SIZE
+#define UL_THAW_SIZE 16
+#endif
+
 #define UL_COMB_LIST(T) \
-    T(S, 3, ul_eval_S) \
-    T(K, 2, ul_eval_K) \
-    T(I, 1, ul_eval_I) 
+    T(S, 3) \
+    T(K, 2) \
+    T(I, 1) \
+    T(V, 1) \
+    T(C, 1) \
+    T(D, 2) \
+    T(Dot, 2)     /* captured[0] is the character */ \
+    T(Promise, 2) /* captured[0] is the offset of the delayed code */ \
+    T(Cont, 2)    /* captured[0] is the frozen stack */ \
+    T(Stack, 0)   /* a frozen stack, never applied, see ul_stack_capture */
 
+/* Opcodes and their number of operands, which are stored unaligned right
+ * after the opcode byte.
+ *
+ *   push             push rt_val
+ *   push1 <val>      push a constant closure
+ *   pop              pop into rt_val
+ *   ld <val>         load a constant closure into rt_val
+ *   swap             exchange rt_val and the top of the stack
+ *   rev <n>          reverse the order of the top n values, n <= 3
+ *   apply_X <n>      apply combinator X to the n values on top of the stack
+ *   apply_unk <n> <ic>
+ *                    apply rt_val to the n values on top of the stack, ic is
+ *                    the index of the site's inline cache
+ *   call <off>       evaluate the unit at off, leaving its value in rt_val
+ *   dcall <off>      like call, unless the top of the stack is d, in which
+ *                    case the unit is delayed into a promise
+ *   promise <off>    delay the unit at off into a promise
+ *   ret              return from a unit
+ *   jmp <off>        continue at off
+ *   stub <ast> <at>  compile ast into a new unit, point the operand at <at>
+ *                    to it and patch itself to jmp
+ *
+ * The rest are superinstructions formed by ul_peephole, picked from the
+ * UL_OPSTATS profile of the t/ programs:
+ *
+ *   push2 <a> <b>    push1 a; push1 b
+ *   apply1 <val> <ic>    push1 val; apply_unk 1 ic
+ *   pdcall <off>         push; dcall off
+ *   swap_apply <n> <ic>  swap; apply_unk n ic
+ *
+ * and the tail applications, which end a unit by applying rt_val in place of
+ * its caller's continuation instead of pushing a frame that would only lead
+ * to the ret:
+ *
+ *   tapply_unk <n> <ic>   apply_unk n ic; ret
+ *   tapply1 <val> <ic>    apply1 val ic; ret
+ *   tswap_apply <n> <ic>  swap_apply n ic; ret
+ */
 #define UL_OPCODE_LIST(T) \
-    T(hlt) \
-    T(push) \
-    T(push1) \
-    T(pop) \
-    T(apply_S) \
-    T(apply_K) \
-    T(apply_I) \
-    T(shuffle) \
-    T(apply_unk) \
+    T(hlt, 0) \
+    T(push, 0) \
+    T(push1, 1) \
+    T(pop, 0) \
+    T(ld, 1) \
+    T(swap, 0) \
+    T(rev, 1) \
+    T(apply_S, 1) \
+    T(apply_K, 1) \
+    T(apply_I, 1) \
+    T(apply_unk, 2) \
+    T(call, 1) \
+    T(dcall, 1) \
+    T(promise, 1) \
+    T(ret, 0) \
+    T(jmp, 1) \
+    T(stub, 2) \
+    T(push2, 2) \
+    T(apply1, 2) \
+    T(pdcall, 1) \
+    T(swap_apply, 2) \
+    T(tapply_unk, 2) \
+    T(tapply1, 2) \
+    T(tswap_apply, 2)
 
 enum {
-#define T(x) x,
+#define T(x, y) x,
+    UL_OPCODE_LIST(T)
+#undef T
+    UL_N_OPS
+};
+
+static const uint8_t ul_op_noperands[] = {
+#define T(x, y) y,
+    UL_OPCODE_LIST(T)
+#undef T
+};
+
+#ifdef UL_OPSTATS
+static const char *ul_op_names[] = {
+#define T(x, y) #x,
     UL_OPCODE_LIST(T)
 #undef T
 };
 
-/* Tagged pointer */
+/* Dynamic counts of adjacent opcode pairs, used to pick superinstructions.
+ * Run a program built with -DUL_OPSTATS and interrupt it. */
+static size_t ul_opstats[UL_N_OPS][UL_N_OPS];
+#define UL_OPSTATS_COUNT(prev, next) (ul_opstats[prev][next]++)
+
+static void ul_opstats_dump(void) {
+    for (int i = 0; i < UL_N_OPS; i++) {
+        for (int j = 0; j < UL_N_OPS; j++) {
+            if (ul_opstats[i][j]) {
+                fprintf(stderr, "%zu %s %s\n", ul_opstats[i][j], ul_op_names[i], ul_op_names[j]);
+            }
+        }
+    }
+}
+
+static void ul_opstats_exit(int sig) {
+    exit(128 + sig);
+}
+#else
+#define UL_OPSTATS_COUNT(prev, next)
+#endif
+
+#ifdef UL_PROF
+/* For the sampling profiler: the instruction about to run or last run, and
+ * one more than the kind of closure being applied since, 0 for none. */
+static uint8_t *volatile ul_prof_pc;
+static volatile unsigned ul_prof_kind;
+#define UL_PROF_PC(pc) (ul_prof_pc = (pc), ul_prof_kind = 0)
+#define UL_PROF_KIND(kind) (ul_prof_kind = (kind) + 1)
+#else
+#define UL_PROF_PC(pc)
+#define UL_PROF_KIND(kind)
+#endif
+
+enum {
+#define T(x, y) UL_COMB_##x,
+    UL_COMB_LIST(T)
+#undef T
+    UL_N_COMBS
+};
+
+#if defined(UL_STATS) || defined(UL_PROF) || defined(UL_CENSUS) || defined(UL_TRACE)
+static const char *ul_comb_names[] = {
+#define T(x, y) #x,
+    UL_COMB_LIST(T)
+#undef T
+};
+#endif
+
+/* Both the profiler and the census map code back to the units it was
+ * compiled in. */
+#if defined(UL_PROF) || defined(UL_CENSUS)
+#define UL_UNITS
+#endif
+
+/* Tagged pointer: closures are word aligned, so the low bit is free to mark
+ * immediates such as return offsets, argument counts and frame markers. */
 typedef uintptr_t ul_value_t;
 
 #define UL_VAL_MASK 0x1
-#define UL_VAL_CLOS 0x1
-#define UL_VAL_COMB 0x0
+#define UL_VAL_CLOS 0x0
+#define UL_VAL_IMM 0x1
+
+#define UL_IMM(x) ((((ul_value_t) (x)) << 1) | UL_VAL_IMM)
+#define UL_IMM_VAL(v) (((ul_value_t) (v)) >> 1)
+#define UL_IS_CLOS(v) ((((ul_value_t) (v)) & UL_VAL_MASK) == UL_VAL_CLOS)
+
+/* Continuation frames live on the VM stack, topped by one of these markers.
+ *
+ *   RET      [off]          resume the bytecode at off
+ *   APPLY    [an .. a1, n]  apply rt_val to the n leftover arguments
+ *   S1       [z, y]         rt_val is xz, go on to evaluate yz
+ *   S2       [xz]           rt_val is yz, apply xz to it
+ *   S3       [z, x]         rt_val is yz, apply x to z and yz
+ */
+enum {
+    UL_FRAME_RET = UL_IMM(0),
+    UL_FRAME_APPLY = UL_IMM(1),
+    UL_FRAME_S1 = UL_IMM(2),
+    UL_FRAME_S2 = UL_IMM(3),
+    UL_FRAME_S3 = UL_IMM(4),
+};
 
 struct ul_closure;
 
+/* A stack segment. The values grow up from base towards limit, which is
+ * followed by an inaccessible guard page. The running stack is a chain of
+ * segments linked by prev, each holding values from lo up. A segment above
+ * the current one is left cached in next when the stack shrinks back below
+ * it. Every segment is also on ctx->segs, for the GC to unmap those that
+ * neither the running stack nor a continuation uses any more. */
+typedef struct ul_seg {
+    struct ul_seg *prev;
+    struct ul_seg *next;
+    struct ul_seg *all;
+    size_t map_size;
+    size_t mark;
+    int frozen;         /* holds values of a continuation below lo */
+    ul_value_t *lo;
+    ul_value_t *limit;
+    ul_value_t base[];
+} ul_seg_t;
+
+/* The most and the least the program allocates between two steps of an
+ * incremental collection. */
+#define UL_GC_STEP (32 * 1024)
+#define UL_GC_STEP_MIN 512
+
+#ifdef UL_STATS
+/* What a run did, for --stats, with -DUL_STATS: reductions by the kind of
+ * closure applied and partial applications, allocations, full collections,
+ * incremental cycles and their steps, the bytes they copied, the largest
+ * the heap and what survived a collection got, and the most values seen on
+ * the running stack. The heap starts out at its smallest size, so a run that
+ * never collects peaks there. The stack is only looked at on segment
+ * switches, collections and the end of the run, so stack_peak is a lower
+ * bound, 0 for a run that halts without leaving its first segment or
+ * collecting. */
+typedef struct {
+    size_t reductions[UL_N_COMBS];
+    size_t partial;
+    size_t alloc_objects;
+    size_t alloc_bytes;
+    size_t gcs;
+    size_t gc_cycles;
+    size_t gc_steps;
+    size_t gc_copied;
+    size_t gc_cycle_alloc; /* alloc_bytes at the start of the cycle under way */
+    size_t heap_peak;
+    size_t live_peak;
+    size_t stack_peak;
+} ul_stats_t;
+
+#define UL_STATS_ADD(ctx, what, n) ((ctx)->stats.what += (n))
+#define UL_STATS_MAX(ctx, what, n) \
+    ((ctx)->stats.what = (size_t) (n) > (ctx)->stats.what ? (size_t) (n) : (ctx)->stats.what)
+#else
+#define UL_STATS_ADD(ctx, what, n) ((void) 0)
+#define UL_STATS_MAX(ctx, what, n) ((void) 0)
+#endif
+
+/* Collection pauses, in buckets a quarter of a power of two of ns wide. */
+#define UL_PAUSE_BUCKETS 256
+
+typedef struct {
+    size_t n;
+    uint64_t total;
+    uint64_t max;
+    size_t hist[UL_PAUSE_BUCKETS];
+} ul_pauses_t;
+
 typedef struct ul_ctx {
-    size_t heap_size;
-    size_t stack_size;
+    size_t heap_size;   /* of each semispace for now */
+    size_t heap_max;    /* mapped for each semispace */
+    size_t stack_size;  /* the size of the first segment */
+    size_t stack_max;
+    size_t stack_mapped;
+    size_t stack_gc_at;
     ul_value_t *sp;
-    uint8_t *stack_base;
+    ul_seg_t *seg;      /* the segment sp points into */
+    ul_seg_t *segs;
+    /* the frozen stack below the bottom of the running one: the record, the
+     * index of its segment and the top of the values left in it */
+    struct ul_closure *below;
+    size_t below_i;
+    ul_value_t *below_top;
+    size_t gc_epoch;
+    size_t gc_live;     /* bytes left after the last collection */
+    int gc_threads;     /* to collect with once gc_live is large enough */
+    long gc_pause;      /* longest pause wanted in ns, 0 to collect all at once */
     uint8_t *gc_allocp;
+    uint8_t *gc_limit;  /* where allocation next calls on the collector */
+    /* the incremental cycle under way: where scanning has got to, or NULL
+     * between cycles, gc_allocp after the last step, the size of from-space
+     * at the start, the bytes the program can still allocate, the bytes of
+     * scanning owed, the frozen stack values left to scan and where the
+     * scan of the running stack has got to */
+    uint8_t *gc_scanp;
+    uint8_t *gc_step_at;
+    size_t gc_step;     /* bytes the program allocates between steps */
+    size_t gc_used;
+    size_t gc_room;
+    long gc_debt;
+    dynbuf_t gc_ranges;
+    ul_seg_t *gc_stack_seg;
+    ul_value_t *gc_stack_p;
+    ul_pauses_t gc_pauses;
+#ifdef UL_STATS
+    ul_stats_t stats;
+#endif
+#ifdef UL_CENSUS
+    /* for --census: the file it goes to, or NULL, the program text, the
+     * collections so far, when the run started and room to tally in */
+    FILE *census;
+    const char *census_text;
+    size_t census_n;
+    uint64_t census_start;
+    dynbuf_t census_buf;
+#endif
+#ifdef UL_TRACE
+    /* for --trace: the file, and the ring of records on their way to it
+     * with where the next one goes and its end, all NULL when not tracing */
+    int trace_fd;
+    ul_trace_rec_t *trace_ring;
+    ul_trace_rec_t *trace_p;
+    ul_trace_rec_t *trace_end;
+#endif
     uint8_t *gc_from;
     uint8_t *gc_to;
+    long fuel;          /* applications left before ul_run suspends */
+    jmp_buf abort;
     struct ul_closure *rt_val;
+    /* where a suspended run goes on: rt_val applied to rt_nargs values, with
+     * the bytecode at rt_pc waiting for the result if rt_in_bc is set */
     uint8_t *rt_pc;
+    size_t rt_nargs;
+    int rt_in_bc;
+    FILE *out;
     dynbuf_t ul_bc;
+    dynbuf_t ul_consts;
+    dynbuf_t ul_ics;
+#ifdef UL_UNITS
+    dynbuf_t ul_units;  /* where each unit starts in ul_bc and its ast, in order */
+#endif
+    ul_ast_t *ast;
+    struct ul_closure *dots[256];
 } ul_ctx_t;
 
+/* Why ul_run returned. A run that is out of fuel is suspended and goes on
+ * from where it stopped when ul_run is called again with ctx->fuel topped
+ * up; after any other status but UL_RUN_HALT the context can only be
+ * destroyed. After UL_RUN_HALT or UL_RUN_FUEL it can also be reset with
+ * ul_ctx_reset to run the program again. */
+enum {
+    UL_RUN_HALT,
+    UL_RUN_FUEL,
+    UL_RUN_OOM,   /* the heap is full of live data, or malloc failed */
+    UL_RUN_STACK, /* the stack would grow past stack_max */
+};
+
 typedef struct {
     size_t n_captured;
     struct ul_closure *captured[];
 } ul_env_t;
 
-typedef void (*ul_closure_fn)(ul_env_t *env, ul_ctx_t *ctx);
-typedef void (*ul_cont_fn)(ul_ctx_t *ctx);
-
 typedef struct ul_closure {
-    union  {
-        ul_closure_fn clos_fn;
-        struct ul_closure *fwd_ptr; /* for GC */
-    };
-    size_t arity;
+    uint32_t kind;
+    uint32_t arity;
+#ifdef UL_CENSUS
+    uint32_t site;      /* the offset in ul_bc of the code that allocated it */
+#endif
+    /* the copy in to-space, for the GC. The original is left as it was, as
+     * an incremental collection goes on running the program on it. */
+    struct ul_closure *fwd;
     ul_env_t env;
 } ul_closure_t;
 
+#ifdef UL_CENSUS
+#define UL_SITE_FILL UINT32_MAX /* of the filler left by the parallel collector */
+#define UL_SITE_SET(clos, at) ((clos)->site = (at))
+#else
+#define UL_SITE_SET(clos, at) ((void) 0)
+#endif
+
+enum {
+#define T(x, y) UL_ARITY_##x = y,
+    UL_COMB_LIST(T)
+#undef T
+};
+
+/* The combinators an atom can stand for, shared by every context. */
+#define UL_ATOM_LIST(T) T(S) T(K) T(I) T(V) T(C) T(D)
+
+#define T(x) \
+    static ul_closure_t ul_##x = { .kind = UL_COMB_##x, .arity = UL_ARITY_##x };
+    UL_ATOM_LIST(T)
+#undef T
+
+static void __attribute__((noreturn)) ul_panic(const char *fmt, ...) {
+    va_list ap;
+    fflush(stdout);
+    va_start(ap, fmt);
+    fputs("ul: ", stderr);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+    exit(1);
+}
+
+/* Give up on the run, returning status from ul_run. */
+static void __attribute__((noreturn)) ul_abort(ul_ctx_t *ctx, int status) {
+    longjmp(ctx->abort, status);
+}
+
+#ifdef UL_STATS
+/* The values on the running stack below sp. Every segment below the one sp
+ * is in is full. */
+static void ul_stats_stack(ul_ctx_t *ctx, ul_value_t *sp) {
+    size_t n = sp - ctx->seg->lo;
+
+    for (ul_seg_t *seg = ctx->seg->prev; seg; seg = seg->prev) {
+        n += seg->limit - seg->lo;
+    }
+    UL_STATS_MAX(ctx, stack_peak, n);
+}
+#define UL_STATS_STACK(ctx, sp) ul_stats_stack(ctx, sp)
+#else
+#define UL_STATS_STACK(ctx, sp) ((void) 0)
+#endif
+
 size_t inline __attribute__((always_inline)) ul_closure_size(size_t n_args) {
     return sizeof(ul_closure_t) + n_args * sizeof(ul_closure_t *);
 }
 
+/* Map a segment with room for at least size bytes of values. */
+static ul_seg_t *ul_seg_new(ul_ctx_t *ctx, size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t map_size = (sizeof(ul_seg_t) + size + page - 1) / page * page + page;
+    ul_seg_t *seg;
+
+    if (ctx->stack_mapped + map_size > ctx->stack_max) {
+        return NULL;
+    }
+    if ((seg = mmap(0, map_size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0)) == MAP_FAILED) {
+        return NULL;
+    }
+    if (mprotect((uint8_t *) seg + map_size - page, page, PROT_NONE) < 0) {
+        munmap(seg, map_size);
+        return NULL;
+    }
+    ctx->stack_mapped += map_size;
+    seg->prev = NULL;
+    seg->next = NULL;
+    seg->all = ctx->segs;
+    ctx->segs = seg;
+    seg->map_size = map_size;
+    seg->mark = 0;
+    seg->frozen = 0;
+    seg->lo = seg->base;
+    seg->limit = (ul_value_t *) ((uint8_t *) seg + map_size - page);
+    return seg;
+}
+
+/* Map a semispace, aligned for huge pages if it is large enough for them. */
+static uint8_t *ul_heap_map(size_t size) {
+    size_t align = size >= UL_HUGE_PAGE ? UL_HUGE_PAGE : 0;
+    uint8_t *map, *p;
+
+    if ((map = mmap(0, size + align, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0)) == MAP_FAILED) {
+        return NULL;
+    }
+    if (!align) {
+        return map;
+    }
+    p = (uint8_t *) (((uintptr_t) map + align - 1) & ~(uintptr_t) (align - 1));
+    if (p > map) {
+        munmap(map, p - map);
+    }
+    munmap(p + size, map + align - p);
+#ifdef MADV_HUGEPAGE
+    madvise(p, size, MADV_HUGEPAGE);
+#endif
+    return p;
+}
+
+/* Give the whole pages of [p, end) of a semispace back to the system. They
+ * read as zeroes when next touched. */
+static void ul_heap_release(ul_ctx_t *ctx, uint8_t *p, uint8_t *end) {
+    uintptr_t page = ctx->heap_max >= UL_HUGE_PAGE ? UL_HUGE_PAGE : sysconf(_SC_PAGESIZE);
+
+    p = (uint8_t *) (((uintptr_t) p + page - 1) & ~(page - 1));
+    if (p < end) {
+        madvise(p, end - p, MADV_DONTNEED);
+    }
+}
+
+static size_t ul_heap_min(ul_ctx_t *ctx) {
+    return ctx->heap_max < UL_HEAP_MIN ? ctx->heap_max : UL_HEAP_MIN;
+}
+
+/* heap_size is the most either semispace can grow to. */
 int ul_ctx_init(ul_ctx_t *ctx, size_t heap_size, size_t stack_size) {
-    if ((ctx->gc_from = mmap(0, heap_size, PROT_READ | PROT_WRITE, MAP_ANON| MAP_PRIVATE, -1, 0)) == MAP_FAILED) {
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    heap_size = (heap_size + page - 1) / page * page;
+    if (!(ctx->gc_from = ul_heap_map(heap_size))) {
         return -1;
     }
-    if ((ctx->gc_to = mmap(0, heap_size, PROT_READ | PROT_WRITE, MAP_ANON| MAP_PRIVATE, -1, 0)) == MAP_FAILED) {
+    if (!(ctx->gc_to = ul_heap_map(heap_size))) {
         goto error1;
     }
-    if ((ctx->sp = mmap(0, stack_size, PROT_READ | PROT_WRITE, MAP_ANON| MAP_PRIVATE, -1, 0)) == MAP_FAILED) {
+    ctx->stack_max = UL_STACK_MAX;
+    ctx->stack_mapped = 0;
+    ctx->segs = NULL;
+    if (!(ctx->seg = ul_seg_new(ctx, stack_size))) {
         goto error2;
     }
     /* cannot fail */
-    ctx->heap_size = heap_size;
+    ctx->heap_max = heap_size;
+    ctx->heap_size = ul_heap_min(ctx);
     ctx->stack_size = stack_size;
-    ctx->stack_base = ctx->sp;
+    ctx->stack_gc_at = UL_STACK_SEG_MAX;
+    ctx->sp = ctx->seg->base;
+    ctx->below = NULL;
+    ctx->below_i = 0;
+    ctx->below_top = NULL;
+    ctx->gc_epoch = 0;
+    ctx->gc_live = 0;
+    ctx->gc_threads = 1;
+    ctx->gc_pause = 0;
     ctx->gc_allocp = ctx->gc_from;
+    ctx->gc_limit = ctx->gc_from + ctx->heap_size;
+    ctx->gc_scanp = NULL;
+    ctx->gc_step = UL_GC_STEP;
+    dynbuf_init(&ctx->gc_ranges);
+    memset(&ctx->gc_pauses, 0, sizeof(ctx->gc_pauses));
+#ifdef UL_STATS
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+#endif
+    UL_STATS_MAX(ctx, heap_peak, ctx->heap_size);
+#ifdef UL_CENSUS
+    ctx->census = NULL;
+    ctx->census_text = NULL;
+    ctx->census_n = 0;
+    ctx->census_start = 0;
+    dynbuf_init(&ctx->census_buf);
+#endif
+#ifdef UL_TRACE
+    ctx->trace_fd = -1;
+    ctx->trace_ring = ctx->trace_p = ctx->trace_end = NULL;
+#endif
+    ctx->fuel = LONG_MAX;
     ctx->rt_val = NULL;
+    ctx->rt_pc = NULL;
+    ctx->rt_nargs = 0;
+    ctx->rt_in_bc = 0;
+    ctx->out = stdout;
+    ctx->ast = NULL;
+    memset(ctx->dots, 0, sizeof(ctx->dots));
     dynbuf_init(&ctx->ul_bc);
+    dynbuf_init(&ctx->ul_consts);
+    dynbuf_init(&ctx->ul_ics);
+#ifdef UL_UNITS
+    dynbuf_init(&ctx->ul_units);
+#endif
     return 0;
 error2:
     munmap(ctx->gc_to, heap_size);
@@ -121,181 +626,3869 @@ error1:
     return -1;
 }
 
-static ul_value_t gc_copy(ul_ctx_t *ctx, ul_value_t ul) {
-#define GC_FWDPTR_TAG ((size_t) -1)
-    ul_closure_t *old = (ul_closure_t *) ul;
+void ul_ctx_destroy(ul_ctx_t *ctx) {
+    munmap(ctx->gc_from, ctx->heap_max);
+    munmap(ctx->gc_to, ctx->heap_max);
+    for (ul_seg_t *seg = ctx->segs, *all; seg; seg = all) {
+        all = seg->all;
+        munmap(seg, seg->map_size);
+    }
+    for (int i = 0; i < 256; i++) {
+        free(ctx->dots[i]);
+    }
+    for (size_t i = 0; i < dynbuf_size(&ctx->ul_consts); i += sizeof(void *)) {
+        void *clos;
+        memcpy(&clos, ctx->ul_consts.data + i, sizeof(clos));
+        free(clos);
+    }
+    dynbuf_free(&ctx->ul_consts);
+    dynbuf_free(&ctx->ul_ics);
+#ifdef UL_UNITS
+    dynbuf_free(&ctx->ul_units);
+#endif
+#ifdef UL_CENSUS
+    dynbuf_free(&ctx->census_buf);
+#endif
+    dynbuf_free(&ctx->gc_ranges);
+    if (ctx->ast) {
+        ul_ast_free(ctx->ast);
+    }
+    dynbuf_free(&ctx->ul_bc);
+}
+
+/* Closures outside of from-space are constants and never move. */
+static ul_closure_t *gc_copy(ul_ctx_t *ctx, ul_closure_t *old) {
+    if ((uint8_t *) old < ctx->gc_from || (uint8_t *) old >= ctx->gc_from + ctx->heap_size) {
+        return old;
+    }
+    if (old->fwd) {
+        return old->fwd;
+    }
     size_t req_size = ul_closure_size(old->env.n_captured);
-    assert(ctx->gc_allocp + req_size < ctx->gc_to + ctx->heap_size);
-    assert(old->env.n_captured != GC_FWDPTR_TAG);
+    assert(ctx->gc_allocp + req_size <= ctx->gc_to + ctx->heap_size);
     /* by the time we are here, the allocp is already pointing into to-space */
     ul_closure_t *new = (ul_closure_t *) ctx->gc_allocp;
     ctx->gc_allocp += req_size;
     memcpy(new, old, req_size);
-    old->fwd_ptr = new;
-    old->env.n_captured = GC_FWDPTR_TAG;
-    return (ul_value_t) new;
+    new->fwd = NULL;
+    old->fwd = new;
+    return new;
 }
 
-static ul_value_t gc(ul_ctx_t *ctx) {
-    uint8_t *scanp;
-    scanp = ctx->gc_allocp = ctx->gc_to;
-    ctx->rt_val = gc_copy(ctx, ctx->rt_val);
-    while (scanp < ctx->gc_allocp) {
-        ul_closure_t *scanned = (ul_closure_t *)scanp;
-        for (size_t i = 0; i < scanned->env.n_captured; i++) {
-            ul_closure_t *ptr = scanned->env.captured[i];
-            if (ptr && ptr->env.n_captured == GC_FWDPTR_TAG) {
-                scanned->env.captured[i] = ptr->fwd_ptr;
-            } else {
-                scanned->env.captured[i] = gc_copy(ctx, ptr);
-            }
+/* A frozen stack record holds the view of the frozen stack below it, then
+ * the segment, lo and top of each of its segments from the bottom up. */
+#define UL_STACK_NSEGS(rec) (((rec)->env.n_captured - 3) / 3)
+#define UL_STACK_SEG(rec, i) ((ul_seg_t *) (rec)->env.captured[3 + 3 * (i)])
+#define UL_STACK_LO(rec, i) ((ul_value_t *) (rec)->env.captured[4 + 3 * (i)])
+#define UL_STACK_TOP(rec, i) ((ul_value_t *) (rec)->env.captured[5 + 3 * (i)])
+
+static void gc_scan_stack(ul_ctx_t *ctx, ul_value_t *lo, ul_value_t *top) {
+    for (ul_value_t *p = lo; p < top; p++) {
+        if (UL_IS_CLOS(*p)) {
+            *p = (ul_value_t) gc_copy(ctx, (ul_closure_t *) *p);
         }
-        scanp += ul_closure_size(scanned->env.n_captured);
     }
-    /* swap the two hemispace */
-    uint8_t *t = ctx->gc_to;
-    ctx->gc_to = ctx->gc_from;
-    ctx->gc_from = t;
-#undef GC_FWDPTR_TAG
 }
 
-ul_closure_t *ul_alloc(ul_ctx_t *ctx, size_t n_args) {
-    size_t size = ul_closure_size(n_args);
-    if (ctx->gc_allocp + size > ctx->gc_from + ctx->heap_size) {
-        gc(ctx);
-        if (ctx->gc_allocp + size > ctx->gc_from + ctx->heap_size) {
+/* Unmap the segments that were not marked, keeping the one cached above the
+ * current segment. */
+static void gc_sweep_stack(ul_ctx_t *ctx) {
+    ul_seg_t **pp = &ctx->segs, *seg;
+
+    if (ctx->seg->next) {
+        ctx->seg->next->mark = ctx->gc_epoch;
+    }
+    while ((seg = *pp)) {
+        if (seg->mark != ctx->gc_epoch) {
+            *pp = seg->all;
+            ctx->stack_mapped -= seg->map_size;
+            munmap(seg, seg->map_size);
+            continue;
+        }
+        if (seg != ctx->seg) {
+            seg->next = NULL;
+        }
+        pp = &seg->all;
+    }
+    ctx->stack_gc_at = 2 * ctx->stack_mapped + UL_STACK_SEG_MAX;
+}
+
+/* Parallel evacuation, for heaps with a lot live. gc_threads workers copy
+ * into buffers of to-space of their own, each Cheney-scanning what it has
+ * copied. The grey objects of a full buffer and the stack ranges found in
+ * frozen stack records go on a list of the worker's own. When a worker
+ * runs out of work and the shared pool is empty, the first worker to
+ * notice hands it the older half of its list, with the grey objects of its
+ * current buffer, through the pool. Closures are claimed by a CAS of fwd
+ * to the address of the copy. A worker that loses the race takes back its
+ * copy, which is always its last allocation.
+ *
+ * The tails of the buffers are filled with unreachable closures, keeping
+ * to-space walkable from one closure to the next. */
+#ifndef UL_GC_THREADS_MIN_LIVE
+#define UL_GC_THREADS_MIN_LIVE (1024 * 1024)
+#endif
+#define UL_GC_TLAB (64 * 1024)
+#define UL_GC_RANGE (16 * 1024)     /* stack values per work item */
+#define UL_GC_DONATE 1024           /* bytes of grey objects worth handing over */
+#define UL_GC_MAX_THREADS 64
+
+typedef struct {
+    uint8_t *lo, *hi;
+    int stack;      /* a range of stack values rather than of closures */
+} ul_gc_work_t;
+
+typedef struct ul_gc_worker {
+    struct ul_gc_par *gc;
+    uint8_t *scan, *alloc, *end;
+    dynbuf_t todo;
+    pthread_t thread;
+} ul_gc_worker_t;
+
+typedef struct ul_gc_par {
+    ul_ctx_t *ctx;
+    uint8_t *top;   /* of to-space handed out */
+    int n_threads;
+    int n_idle;
+    int starving;   /* the pool is empty and a worker waits, read without the lock */
+    int failed;
+    int done;
+    dynbuf_t pool;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    ul_gc_worker_t workers[UL_GC_MAX_THREADS];
+} ul_gc_par_t;
+
+static void gc_par_push(ul_gc_worker_t *w, uint8_t *lo, uint8_t *hi, int stack) {
+    ul_gc_work_t work = { lo, hi, stack };
+
+    if (dynbuf_put(&w->todo, (uint8_t *) &work, sizeof(work)) < 0) {
+        __atomic_store_n(&w->gc->failed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void gc_par_push_stack(ul_gc_worker_t *w, ul_value_t *lo, ul_value_t *top) {
+    for (; top - lo > UL_GC_RANGE; lo += UL_GC_RANGE) {
+        gc_par_push(w, (uint8_t *) lo, (uint8_t *) (lo + UL_GC_RANGE), 1);
+    }
+    if (top > lo) {
+        gc_par_push(w, (uint8_t *) lo, (uint8_t *) top, 1);
+    }
+}
+
+/* Hand the older half of w's list, with the grey objects of its buffer,
+ * over to the pool. */
+static void gc_par_share(ul_gc_worker_t *w) {
+    ul_gc_par_t *gc = w->gc;
+    size_t n;
+
+    if (w->alloc - w->scan >= UL_GC_DONATE) {
+        gc_par_push(w, w->scan, w->alloc, 0);
+        w->scan = w->alloc;
+    }
+    if (!(n = dynbuf_size(&w->todo) / sizeof(ul_gc_work_t))) {
+        return;
+    }
+    n = (n + 1) / 2 * sizeof(ul_gc_work_t);
+    pthread_mutex_lock(&gc->lock);
+    if (dynbuf_put(&gc->pool, w->todo.data, n) < 0) {
+        gc->failed = 1;
+    }
+    __atomic_store_n(&gc->starving, 0, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&gc->cond);
+    pthread_mutex_unlock(&gc->lock);
+    w->todo.size -= n;
+    memmove(w->todo.data, w->todo.data + n, w->todo.size);
+}
+
+/* Fill from p to end, at least a closure header, with a closure. */
+static void gc_par_fill(uint8_t *p, uint8_t *end) {
+    ul_closure_t *fill = (ul_closure_t *) p;
+
+    if (p == end) {
+        return;
+    }
+    fill->kind = UL_COMB_I;
+    fill->arity = UL_ARITY_I;
+    UL_SITE_SET(fill, UL_SITE_FILL);
+    fill->fwd = NULL;
+    fill->env.n_captured = (end - p - sizeof(ul_closure_t)) / sizeof(ul_closure_t *);
+    memset(fill->env.captured, 0, end - p - sizeof(ul_closure_t));
+}
+
+/* Allocate size bytes of to-space. A buffer is never left with a tail too
+ * small for a closure header. */
+static uint8_t *gc_par_alloc(ul_gc_worker_t *w, size_t size) {
+    ul_gc_par_t *gc = w->gc;
+    uint8_t *end = gc->ctx->gc_to + gc->ctx->heap_size, *top, *p;
+    size_t want;
+
+    if (w->alloc + size == w->end || w->alloc + size + sizeof(ul_closure_t) <= w->end) {
+        p = w->alloc;
+        w->alloc += size;
+        return p;
+    }
+    if (w->scan < w->alloc) {
+        gc_par_push(w, w->scan, w->alloc, 0);
+    }
+    gc_par_fill(w->alloc, w->end);
+    top = __atomic_load_n(&gc->top, __ATOMIC_RELAXED);
+    do {
+        want = (size_t) (end - top) >= UL_GC_TLAB + size ? UL_GC_TLAB : size;
+        if (top + want > end) {
+            __atomic_store_n(&gc->failed, 1, __ATOMIC_RELAXED);
+            w->scan = w->alloc = w->end;
             return NULL;
         }
+    } while (!__atomic_compare_exchange_n(&gc->top, &top, top + want, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    w->scan = w->alloc = top;
+    w->end = top + want;
+    w->alloc += size;
+    return top;
+}
+
+static ul_closure_t *gc_par_copy(ul_gc_worker_t *w, ul_closure_t *old) {
+    ul_ctx_t *ctx = w->gc->ctx;
+    ul_closure_t *new, *fwd;
+    size_t size;
+
+    if ((uint8_t *) old < ctx->gc_from || (uint8_t *) old >= ctx->gc_from + ctx->heap_size) {
+        return old;
+    }
+    if ((fwd = __atomic_load_n(&old->fwd, __ATOMIC_ACQUIRE))) {
+        return fwd;
+    }
+    size = ul_closure_size(old->env.n_captured);
+    if (!(new = (ul_closure_t *) gc_par_alloc(w, size))) {
+        return old;
+    }
+    new->kind = old->kind;
+    new->arity = old->arity;
+    UL_SITE_SET(new, old->site);
+    new->fwd = NULL;
+    memcpy(&new->env, &old->env, size - offsetof(ul_closure_t, env));
+    if (!__atomic_compare_exchange_n(&old->fwd, &fwd, new, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        w->alloc = (uint8_t *) new;
+        return fwd;
     }
-    ul_closure_t *new = (ul_closure_t *) ctx->gc_allocp;
-    ctx->gc_allocp += size;
     return new;
 }
 
-static inline __attribute__((always_inline)) void ul_push(ul_ctx_t *ctx, ul_value_t val) {
-    assert(ctx->sp < ctx->stack_base);
-    *ctx->sp++ = val;
+/* Segments shared by several records are scanned by whichever workers get
+ * to them, so the values are read and written atomically. */
+static void gc_par_scan_stack(ul_gc_worker_t *w, ul_value_t *lo, ul_value_t *top) {
+    for (ul_value_t *p = lo; p < top; p++) {
+        ul_value_t v = __atomic_load_n(p, __ATOMIC_RELAXED);
+        if (UL_IS_CLOS(v)) {
+            __atomic_store_n(p, (ul_value_t) gc_par_copy(w, (ul_closure_t *) v), __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void gc_par_scan(ul_gc_worker_t *w, ul_closure_t *scanned) {
+    for (size_t i = 0; i < scanned->env.n_captured; i++) {
+        ul_closure_t *ptr = scanned->env.captured[i];
+        if (UL_IS_CLOS(ptr)) {
+            scanned->env.captured[i] = gc_par_copy(w, ptr);
+        }
+    }
+    if (scanned->kind == UL_COMB_Stack) {
+        for (size_t i = 0; i < UL_STACK_NSEGS(scanned); i++) {
+            __atomic_store_n(&UL_STACK_SEG(scanned, i)->mark, w->gc->ctx->gc_epoch, __ATOMIC_RELAXED);
+            gc_par_push_stack(w, UL_STACK_LO(scanned, i), UL_STACK_TOP(scanned, i));
+        }
+    }
 }
 
-static inline __attribute__((always_inline)) ul_value_t ul_pop(ul_ctx_t *ctx) {
-    assert(ctx->sp > ctx->stack_base + ctx->stack_size);
-    return *(--ctx->sp);
+/* Take work from w's list or the pool, waiting for some while any worker
+ * is busy. */
+static int gc_par_take(ul_gc_worker_t *w, ul_gc_work_t *work) {
+    ul_gc_par_t *gc = w->gc;
+
+    if (dynbuf_size(&w->todo)) {
+        w->todo.size -= sizeof(*work);
+        memcpy(work, w->todo.data + w->todo.size, sizeof(*work));
+        return 1;
+    }
+    pthread_mutex_lock(&gc->lock);
+    if (!dynbuf_size(&gc->pool)) {
+        if (++gc->n_idle == gc->n_threads) {
+            gc->done = 1;
+            pthread_cond_broadcast(&gc->cond);
+        }
+        while (!gc->done && !dynbuf_size(&gc->pool)) {
+            __atomic_store_n(&gc->starving, 1, __ATOMIC_RELAXED);
+            pthread_cond_wait(&gc->cond, &gc->lock);
+        }
+        if (gc->done) {
+            pthread_mutex_unlock(&gc->lock);
+            return 0;
+        }
+        gc->n_idle--;
+    }
+    gc->pool.size -= sizeof(*work);
+    memcpy(work, gc->pool.data + gc->pool.size, sizeof(*work));
+    pthread_mutex_unlock(&gc->lock);
+    return 1;
 }
 
-static void ul_apply_cont(ul_ctx_t *ctx) {
-    size_t rest = ul_pop(ctx);
+static void *gc_par_main(void *arg) {
+    ul_gc_worker_t *w = arg;
+    ul_gc_work_t work;
+
+    for (;;) {
+        while (w->scan < w->alloc) {
+            ul_closure_t *scanned = (ul_closure_t *) w->scan;
+            w->scan += ul_closure_size(scanned->env.n_captured);
+            gc_par_scan(w, scanned);
+            if (__atomic_load_n(&w->gc->starving, __ATOMIC_RELAXED)) {
+                gc_par_share(w);
+            }
+        }
+        if (!gc_par_take(w, &work)) {
+            return NULL;
+        }
+        if (work.stack) {
+            gc_par_scan_stack(w, (ul_value_t *) work.lo, (ul_value_t *) work.hi);
+        } else {
+            for (uint8_t *p = work.lo; p < work.hi; ) {
+                ul_closure_t *scanned = (ul_closure_t *) p;
+                p += ul_closure_size(scanned->env.n_captured);
+                gc_par_scan(w, scanned);
+            }
+        }
+        if (__atomic_load_n(&w->gc->starving, __ATOMIC_RELAXED)) {
+            gc_par_share(w);
+        }
+    }
 }
 
+/* Evacuate from-space into to-space with ctx->gc_threads workers, the
+ * calling thread being the first. */
+static void gc_par(ul_ctx_t *ctx) {
+    ul_gc_par_t *gc;
+    ul_gc_worker_t *w;
+    int n = ctx->gc_threads < UL_GC_MAX_THREADS ? ctx->gc_threads : UL_GC_MAX_THREADS, failed;
+
+    if (!(gc = calloc(1, sizeof(*gc)))) {
+        ul_abort(ctx, UL_RUN_OOM);
+    }
+    gc->ctx = ctx;
+    gc->top = ctx->gc_to;
+    gc->n_threads = n;
+    dynbuf_init(&gc->pool);
+    pthread_mutex_init(&gc->lock, NULL);
+    pthread_cond_init(&gc->cond, NULL);
+    for (int i = 0; i < n; i++) {
+        w = &gc->workers[i];
+        w->gc = gc;
+        w->scan = w->alloc = w->end = ctx->gc_to;
+        dynbuf_init(&w->todo);
+    }
+    w = &gc->workers[0];
+    if (ctx->rt_val) {
+        ctx->rt_val = gc_par_copy(w, ctx->rt_val);
+    }
+    if (ctx->below) {
+        ctx->below = gc_par_copy(w, ctx->below);
+    }
+    for (ul_seg_t *seg = ctx->seg; seg; seg = seg->prev) {
+        seg->mark = ctx->gc_epoch;
+        gc_par_push_stack(w, seg->lo, seg == ctx->seg ? ctx->sp : seg->limit);
+    }
+    /* the roots are shared out from the start */
+    if (dynbuf_put(&gc->pool, w->todo.data, dynbuf_size(&w->todo)) < 0) {
+        gc->failed = 1;
+    }
+    w->todo.size = 0;
+    for (int i = 1; i < n; i++) {
+        if (pthread_create(&gc->workers[i].thread, NULL, gc_par_main, &gc->workers[i])) {
+            /* the workers started so far do it all */
+            pthread_mutex_lock(&gc->lock);
+            gc->n_threads = n = i;
+            pthread_mutex_unlock(&gc->lock);
+            break;
+        }
+    }
+    gc_par_main(w);
+    for (int i = 1; i < n; i++) {
+        pthread_join(gc->workers[i].thread, NULL);
+    }
+    for (int i = 0; i < n; i++) {
+        gc_par_fill(gc->workers[i].alloc, gc->workers[i].end);
+        dynbuf_free(&gc->workers[i].todo);
+    }
+    ctx->gc_allocp = gc->top;
+    failed = gc->failed;
+    pthread_mutex_destroy(&gc->lock);
+    pthread_cond_destroy(&gc->cond);
+    dynbuf_free(&gc->pool);
+    free(gc);
+    if (failed) {
+        ul_abort(ctx, UL_RUN_OOM);
+    }
+}
 
-/* Sxyz = xz(yz) */
-static void ul_eval_S(ul_ctx_t *ctx) {
-    ul_value_t x, y, z;
-    x = ctx->sp[0];
-    y = ctx->sp[1];
-    z = ctx->sp[2];
-    // ctx->sp -= 3;
-    // ctx->rt_val = z;
-    // ul_push(ctx, (ul_value_t) z);
-    // ul_push(ctx, (ul_value_t) x);
-    // ul_push(ctx, (ul_value_t) &ul_S_cont2);
-    // ul_push(ctx, (ul_value_t) y);
-    // ul_push(ctx, (ul_value_t) &ul_S_cont1 | UL_VAL_COMB);
+static uint64_t ul_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-static void ul_eval_K(ul_ctx_t *ctx) {
-    ctx->rt_val = ctx->sp[0];
-    ctx->sp -= 2;
+static size_t ul_pause_bucket(uint64_t ns) {
+    int e;
+
+    if (ns < 4) {
+        return ns;
+    }
+    e = 63 - __builtin_clzll(ns);
+    return 4 * (e - 1) + ((ns >> (e - 2)) & 3);
 }
-static void ul_eval_I(ul_ctx_t *ctx) {
-    ctx->rt_val = ctx->sp[0];
-    --ctx->sp;
+
+/* Count a pause that started at start. */
+static void ul_pause(ul_ctx_t *ctx, uint64_t start) {
+    ul_pauses_t *p = &ctx->gc_pauses;
+    uint64_t ns = ul_now_ns() - start;
+
+    p->n++;
+    p->total += ns;
+    if (ns > p->max) {
+        p->max = ns;
+    }
+    p->hist[ul_pause_bucket(ns)]++;
 }
 
-static int ul_value_is_cont(ul_value_t val) {
-    return val == &ul_apply_cont;
+/* Incremental collection, for pauses of gc_pause ns at most. A cycle starts
+ * once half the heap is in use. From then on the program allocates in
+ * to-space, and every gc_step bytes it stops for a step of scanning, cut
+ * short at gc_pause. gc_step halves after a step that takes over half of
+ * gc_pause and doubles back after a short one. Closures never change once
+ * made but for the code offset of a promise, so the collector replicates
+ * them: the program goes on with the originals in from-space, and only the
+ * flip at the end of the cycle moves its registers and running stack over
+ * to the copies. The running stack is scanned bottom up during the cycle
+ * too, as far as it holds by then, which leaves the flip little more to do
+ * than check it.
+ *
+ * The program can allocate as much of to-space as from-space left free
+ * when the cycle started, keeping room to copy all of from-space. Each byte
+ * of that is charged enough scanning for the cycle to finish in time even
+ * with all of from-space and of the stack segments live. When the steps
+ * fall behind, the last one finishes the cycle in one go. */
+#define UL_GC_CLOCK (8 * 1024) /* bytes scanned between looks at the clock */
+
+/* Set where allocation next has to call on the collector: the end of the
+ * heap, or where the next incremental cycle or step is due. */
+static void gc_set_limit(ul_ctx_t *ctx) {
+    if (ctx->gc_scanp) {
+        ctx->gc_limit = ctx->gc_step_at + (ctx->gc_room < ctx->gc_step ? ctx->gc_room : ctx->gc_step);
+    } else if (ctx->gc_pause) {
+        ctx->gc_limit = ctx->gc_from + ctx->heap_size / 2;
+    } else {
+        ctx->gc_limit = ctx->gc_from + ctx->heap_size;
+    }
 }
 
-void ul_run(ul_ctx_t *ctx) {
-    uint8_t *pc = ctx->ul_bc.data, op;
-    ul_cont_fn kont;
-    size_t nargs;
-    ul_closure_t *clos;
-    static struct {
-        int arity;
-        void (*eval_fn)(ul_ctx_t *);
-    } *desc, comb_descs[] = { 
-#define T(x, y, z) y,
-        UL_COMB_LIST(T)
-#undef T
-    };
-#define GET_NARGS() memcpy(&nargs, pc, sizeof(nargs))
-#ifdef DIRECT_THREADING
-    void *jmptbl[] = {
-        #define T(op) &&jmptbl_##op,
-        UL_OPCODE_LIST(T)
-        #undef T
-    };
-    #define CASE(op) jmptbl_##op
-    #define SWITCH(pc) goto *jmptbl[(op = *pc++)];
-    #define BREAK goto *jmptbl[*pc++]
-    #define CONTINUE goto *jmptbl[*pc++]
-#else
-    #define SWITCH(pc) switch((op = *pc++))
-    #define CASE(op) op
-    #define BREAK break
-    #define CONTINUE goto decode
-decode:
-#endif
-    SWITCH(pc) {
-        CASE(push1):
-            GET_NARGS();
-            ctx->rt_val = nargs;
-        CASE(push):
-            ul_push(ctx, ctx->rt_val);
-            BREAK;
-        CASE(pop):
-            ctx->rt_val = ul_pop(ctx);
-            BREAK;
-        CASE(apply_K):
-        CASE(apply_S):
-        CASE(apply_I):
-            GET_NARGS();
-            desc = &comb_descs[op - apply_K];
-            if (nargs >= desc->arity) {
-                if (nargs > desc->arity) {
-                    /* we have to push a continuation on the stack */
-                    ul_push(ctx, nargs - desc->arity);
-                    ul_push(ctx, &ul_apply_cont);
-                }
-                desc->eval_fn(ctx);
-            } else {
-                /* we can set rt_val */
-                clos = ul_alloc(ctx, nargs);
-                assert(clos);
-                clos->env.n_captured = nargs;
-                for (size_t i = 0; i < nargs; i++) {
-                }
-                ctx->rt_val = clos;
-            }
-            /* always try to scrutinize the closure as unlambda is a strict language */
-            goto scrutinize;
-        CASE(apply_unk):
-        CASE(shuffle):
-        CASE(hlt):
-            return;
+/* Size the heap for what survived the last collection and need bytes the
+ * program is about to allocate. With a collection due once the heap is full,
+ * gc_live over heap_size is the share that survives one: the heap doubles
+ * while that is over a quarter, and halves back once it is under a
+ * sixteenth. */
+static void gc_resize(ul_ctx_t *ctx, size_t need) {
+    size_t want = 4 * ctx->gc_live + need, size = ctx->heap_size;
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    while (size < want && size < ctx->heap_max) {
+        size *= 2;
+    }
+    if (size >= 4 * want && size / 2 >= ul_heap_min(ctx)) {
+        size /= 2;
     }
-scrutinize:
-    while (ul_value_is_cont(*ctx->sp)) {
-        kont = (ul_cont_fn)ul_pop(ctx);
-        kont(ctx);
+    size = size > ctx->heap_max ? ctx->heap_max : size / page * page;
+    if (size < ctx->heap_size) {
+        ul_heap_release(ctx, ctx->gc_from + size, ctx->gc_from + ctx->heap_size);
     }
-    CONTINUE;
+    ctx->heap_size = size;
+    UL_STATS_MAX(ctx, heap_peak, size);
 }
 
-int main() {
-    ul_ctx_t ctx;
-    assert(ul_ctx_init(&ctx, 4096, 4096) == 0);
-    dynbuf_put_uint8_t(&ctx.ul_bc, hlt);
-    ul_run(&ctx);
-    return 0;
-}
\ No newline at end of file
+#ifdef UL_UNITS
+#define UL_UNIT_TEXT 16 /* characters of the program text shown for a unit */
+
+/* Show the unit compiled from ast as its offset in text and its first few
+ * characters. */
+static void ul_unit_show(FILE *out, const char *text, ul_ast_t *ast) {
+    const char *p = text + ast->off;
+
+    fprintf(out, "%zu:", ast->off);
+    for (int i = 0; i < UL_UNIT_TEXT && p[i]; i++) {
+        /* ; separates the frames of a profile, and spaces the fields */
+        putc(isgraph((unsigned char) p[i]) && p[i] != ';' ? p[i] : '_', out);
+    }
+}
+#endif
+
+#ifdef UL_CENSUS
+/* Heap census, with -DUL_CENSUS. Every closure records the code that
+ * allocated it, and what is in from-space after each collection is tallied
+ * by the unit that code is in and the shape of the closure: its kind and
+ * how many arguments it has captured, a partial application of s to one
+ * argument being S/1. --census writes a line for each at each collection,
+ *
+ *   collection ms unit kind/captured objects bytes
+ *
+ * the unit shown as for the profiler, or as ? for code not compiled from
+ * the text. After an incremental cycle the tally includes what the program
+ * allocated during it. */
+
+/* The index of the unit the code at off is in, or -1 for none. The units
+ * are in the order of where they start. */
+static ssize_t ul_unit_at(ul_ctx_t *ctx, size_t off) {
+    size_t *units = (size_t *) ctx->ul_units.data, lo = 0, hi, mid;
+
+    hi = dynbuf_size(&ctx->ul_units) / (2 * sizeof(size_t));
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (units[2 * mid] <= off) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (ssize_t) lo - 1;
+}
+
+typedef struct {
+    uint64_t key;       /* one more than the unit, the kind and the captured */
+    size_t size;
+} ul_census_obj_t;
+
+static int ul_census_cmp(const void *a, const void *b) {
+    uint64_t x = ((ul_census_obj_t *) a)->key, y = ((ul_census_obj_t *) b)->key;
+    return x < y ? -1 : x > y;
+}
+
+static void ul_census(ul_ctx_t *ctx) {
+    ul_census_obj_t obj, *objs;
+    ul_closure_t *clos;
+    size_t n, i, j, bytes;
+    ssize_t unit;
+    unsigned kind;
+    double ms;
+
+    if (!ctx->census) {
+        return;
+    }
+    ms = (ul_now_ns() - ctx->census_start) / 1e6;
+    ctx->census_n++;
+    ctx->census_buf.size = 0;
+    for (uint8_t *p = ctx->gc_from; p < ctx->gc_allocp; p += obj.size) {
+        clos = (ul_closure_t *) p;
+        obj.size = ul_closure_size(clos->env.n_captured);
+        if (clos->site == UL_SITE_FILL) {
+            continue;
+        }
+        obj.key = (uint64_t) (ul_unit_at(ctx, clos->site) + 1) << 16 | clos->kind << 8 |
+                  (clos->kind == UL_COMB_Stack ? 0 : clos->env.n_captured & 0xff);
+        if (dynbuf_put(&ctx->census_buf, (uint8_t *) &obj, sizeof(obj)) < 0) {
+            ul_abort(ctx, UL_RUN_OOM);
+        }
+    }
+    objs = (ul_census_obj_t *) ctx->census_buf.data;
+    if (!(n = dynbuf_size(&ctx->census_buf) / sizeof(obj))) {
+        return;
+    }
+    qsort(objs, n, sizeof(obj), ul_census_cmp);
+    for (i = 0; i < n; i = j) {
+        for (j = i, bytes = 0; j < n && objs[j].key == objs[i].key; j++) {
+            bytes += objs[j].size;
+        }
+        unit = (ssize_t) (objs[i].key >> 16) - 1;
+        kind = objs[i].key >> 8 & 0xff;
+        fprintf(ctx->census, "%zu %.3f ", ctx->census_n, ms);
+        if (unit < 0) {
+            putc('?', ctx->census);
+        } else {
+            ul_unit_show(ctx->census, ctx->census_text, ((ul_ast_t **) ctx->ul_units.data)[2 * unit + 1]);
+        }
+        if (kind == UL_COMB_Stack) {
+            fprintf(ctx->census, " %s", ul_comb_names[kind]);
+        } else {
+            fprintf(ctx->census, " %s/%u", ul_comb_names[kind], (unsigned) (objs[i].key & 0xff));
+        }
+        fprintf(ctx->census, " %zu %zu\n", j - i, bytes);
+    }
+    /* for the last collection before the heap runs out, or a crash */
+    fflush(ctx->census);
+}
+
+static void ul_census_start(ul_ctx_t *ctx, const char *text, const char *file) {
+    if (!text) {
+        ul_panic("--census needs the program text");
+    }
+    if (!(ctx->census = fopen(file, "w"))) {
+        ul_panic("cannot write census %s: %s", file, strerror(errno));
+    }
+    ctx->census_text = text;
+    ctx->census_start = ul_now_ns();
+}
+#define UL_CENSUS_TAKE(ctx) ul_census(ctx)
+#else
+#define UL_CENSUS_TAKE(ctx) ((void) 0)
+#endif
+
+/* Swap the two hemispaces once everything live has been copied. The next
+ * collection copies into the one left behind, which is given back to the
+ * system but for about as much as survived this one. */
+static void gc_swap(ul_ctx_t *ctx) {
+    uint8_t *t = ctx->gc_to;
+    ctx->gc_to = ctx->gc_from;
+    ctx->gc_from = t;
+    ctx->gc_live = ctx->gc_allocp - ctx->gc_from;
+    UL_STATS_MAX(ctx, live_peak, ctx->gc_live);
+    ul_heap_release(ctx, ctx->gc_to + ctx->gc_live, ctx->gc_to + ctx->heap_size);
+    gc_sweep_stack(ctx);
+    gc_resize(ctx, 0);
+    gc_set_limit(ctx);
+    UL_CENSUS_TAKE(ctx);
+}
+
+static void gc_incr_push(ul_ctx_t *ctx, ul_value_t *lo, ul_value_t *top) {
+    ul_value_t *range[2] = { lo, top };
+
+    if (top > lo && dynbuf_put(&ctx->gc_ranges, (uint8_t *) range, sizeof(range)) < 0) {
+        ul_abort(ctx, UL_RUN_OOM);
+    }
+}
+
+/* Scan the next values of the running stack up from where the last call
+ * left off, starting over at the bottom if the segment it was in has left
+ * the running stack since. Returns 0 once at the top. */
+static int gc_incr_scan_running(ul_ctx_t *ctx, long *work) {
+    ul_seg_t *seg, *above = NULL;
+    ul_value_t *p, *top;
+
+    for (seg = ctx->seg; seg && seg != ctx->gc_stack_seg; seg = seg->prev) {
+        above = seg;
+    }
+    if (!seg) {
+        /* frozen by c, and scanned with the record */
+        ctx->gc_stack_seg = above;
+        ctx->gc_stack_p = above->lo;
+        return 1;
+    }
+    top = seg == ctx->seg ? ctx->sp : seg->limit;
+    p = ctx->gc_stack_p < seg->lo ? seg->lo : ctx->gc_stack_p;
+    if (p >= top) {
+        if (!above) {
+            return 0;
+        }
+        ctx->gc_stack_seg = above;
+        ctx->gc_stack_p = above->lo;
+        return 1;
+    }
+    top = (size_t) (top - p) > UL_GC_CLOCK / sizeof(ul_value_t) ? p + UL_GC_CLOCK / sizeof(ul_value_t) : top;
+    gc_scan_stack(ctx, p, top);
+    *work -= (top - p) * sizeof(ul_value_t);
+    ctx->gc_stack_p = top;
+    return 1;
+}
+
+/* Scan until work bytes have been, or deadline if there is one. Returns
+ * whether there is nothing left to scan. */
+static int gc_incr_scan(ul_ctx_t *ctx, long *work, uint64_t deadline) {
+    for (long last = *work; *work > 0; ) {
+        if (deadline && last - *work >= UL_GC_CLOCK) {
+            if (ul_now_ns() >= deadline) {
+                return 0;
+            }
+            last = *work;
+        }
+        if (ctx->gc_scanp < ctx->gc_allocp) {
+            ul_closure_t *scanned = (ul_closure_t *) ctx->gc_scanp;
+            size_t size = ul_closure_size(scanned->env.n_captured);
+            for (size_t i = 0; i < scanned->env.n_captured; i++) {
+                ul_closure_t *ptr = scanned->env.captured[i];
+                if (UL_IS_CLOS(ptr)) {
+                    scanned->env.captured[i] = gc_copy(ctx, ptr);
+                }
+            }
+            if (scanned->kind == UL_COMB_Stack) {
+                for (size_t i = 0; i < UL_STACK_NSEGS(scanned); i++) {
+                    UL_STACK_SEG(scanned, i)->mark = ctx->gc_epoch;
+                    gc_incr_push(ctx, UL_STACK_LO(scanned, i), UL_STACK_TOP(scanned, i));
+                }
+            }
+            ctx->gc_scanp += size;
+            *work -= size;
+        } else if (dynbuf_size(&ctx->gc_ranges)) {
+            /* the top UL_GC_CLOCK bytes of the last range */
+            ul_value_t **range = (ul_value_t **) (ctx->gc_ranges.data + dynbuf_size(&ctx->gc_ranges)) - 2;
+            ul_value_t *lo = range[0], *top = range[1];
+            if ((size_t) (top - lo) > UL_GC_CLOCK / sizeof(ul_value_t)) {
+                lo = range[1] = top - UL_GC_CLOCK / sizeof(ul_value_t);
+            } else {
+                ctx->gc_ranges.size -= 2 * sizeof(ul_value_t *);
+            }
+            gc_scan_stack(ctx, lo, top);
+            *work -= (top - lo) * sizeof(ul_value_t);
+        } else if (!ctx->gc_stack_seg || !gc_incr_scan_running(ctx, work)) {
+            ctx->gc_stack_seg = NULL;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void gc_incr_start(ul_ctx_t *ctx) {
+    ctx->gc_epoch++;
+    UL_STATS_ADD(ctx, gc_cycles, 1);
+#ifdef UL_STATS
+    ctx->stats.gc_cycle_alloc = ctx->stats.alloc_bytes;
+#endif
+    ctx->gc_used = ctx->gc_allocp - ctx->gc_from;
+    ctx->gc_room = ctx->heap_size - ctx->gc_used;
+    ctx->gc_debt = 0;
+    ctx->gc_scanp = ctx->gc_allocp = ctx->gc_to;
+    if (ctx->rt_val) {
+        ctx->rt_val = gc_copy(ctx, ctx->rt_val);
+    }
+    if (ctx->below) {
+        ctx->below = gc_copy(ctx, ctx->below);
+    }
+    ctx->gc_step_at = ctx->gc_allocp;
+    for (ctx->gc_stack_seg = ctx->seg; ctx->gc_stack_seg->prev; ctx->gc_stack_seg = ctx->gc_stack_seg->prev) {
+    }
+    ctx->gc_stack_p = ctx->gc_stack_seg->lo;
+    gc_set_limit(ctx);
+}
+
+/* The flip: move the registers and the running stack over to the copies,
+ * scan whatever that finds and swap the hemispaces. */
+static void gc_incr_finish(ul_ctx_t *ctx) {
+    long work = LONG_MAX;
+
+    if (ctx->rt_val) {
+        ctx->rt_val = gc_copy(ctx, ctx->rt_val);
+    }
+    if (ctx->below) {
+        ctx->below = gc_copy(ctx, ctx->below);
+    }
+    for (ul_seg_t *seg = ctx->seg; seg; seg = seg->prev) {
+        seg->mark = ctx->gc_epoch;
+        gc_scan_stack(ctx, seg->lo, seg == ctx->seg ? ctx->sp : seg->limit);
+    }
+    ctx->gc_stack_seg = NULL;
+    gc_incr_scan(ctx, &work, 0);
+    ctx->gc_scanp = NULL;
+    /* what the program allocated meanwhile was not copied */
+    UL_STATS_ADD(ctx, gc_copied, ctx->gc_allocp - ctx->gc_to - (ctx->stats.alloc_bytes - ctx->stats.gc_cycle_alloc));
+    gc_swap(ctx);
+}
+
+/* A step of the cycle under way, for what the program allocated since the
+ * last one, finishing the cycle if it leaves no room for size bytes. */
+static void gc_incr_step(ul_ctx_t *ctx, size_t size) {
+    size_t allocated = ctx->gc_allocp - ctx->gc_step_at;
+    uint64_t start = ul_now_ns(), ns;
+
+    UL_STATS_ADD(ctx, gc_steps, 1);
+    ctx->gc_room -= allocated;
+    ctx->gc_debt += allocated * (ctx->heap_size + ctx->stack_mapped) / (ctx->heap_size - ctx->gc_used);
+    if (gc_incr_scan(ctx, &ctx->gc_debt, start + ctx->gc_pause) || ctx->gc_room < size) {
+        gc_incr_finish(ctx);
+        return;
+    }
+    if ((ns = ul_now_ns() - start) > (uint64_t) ctx->gc_pause / 2 && ctx->gc_step > UL_GC_STEP_MIN) {
+        ctx->gc_step /= 2;
+    } else if (ns < (uint64_t) ctx->gc_pause / 8 && ctx->gc_step < UL_GC_STEP) {
+        ctx->gc_step *= 2;
+    }
+    ctx->gc_step_at = ctx->gc_allocp;
+    gc_set_limit(ctx);
+}
+
+static void gc(ul_ctx_t *ctx) {
+    uint8_t *scanp;
+    if (ctx->gc_scanp) {
+        /* finish the cycle under way rather than start over */
+        gc_incr_finish(ctx);
+        return;
+    }
+    ctx->gc_epoch++;
+    UL_STATS_ADD(ctx, gcs, 1);
+    /* the buffers waste up to a few of UL_GC_TLAB per worker, and a
+     * parallel copy that runs out of to-space cannot be retried, so only
+     * go parallel while the last live set left half the heap free */
+    if (ctx->gc_threads > 1 && ctx->gc_live >= UL_GC_THREADS_MIN_LIVE
+            && ctx->gc_live + 2 * ctx->gc_threads * UL_GC_TLAB <= ctx->heap_size / 2) {
+        gc_par(ctx);
+        goto swap;
+    }
+    scanp = ctx->gc_allocp = ctx->gc_to;
+    if (ctx->rt_val) {
+        ctx->rt_val = gc_copy(ctx, ctx->rt_val);
+    }
+    for (ul_seg_t *seg = ctx->seg; seg; seg = seg->prev) {
+        seg->mark = ctx->gc_epoch;
+        gc_scan_stack(ctx, seg->lo, seg == ctx->seg ? ctx->sp : seg->limit);
+    }
+    if (ctx->below) {
+        ctx->below = gc_copy(ctx, ctx->below);
+    }
+    while (scanp < ctx->gc_allocp) {
+        ul_closure_t *scanned = (ul_closure_t *)scanp;
+        for (size_t i = 0; i < scanned->env.n_captured; i++) {
+            ul_closure_t *ptr = scanned->env.captured[i];
+            if (UL_IS_CLOS(ptr)) {
+                scanned->env.captured[i] = gc_copy(ctx, ptr);
+            }
+        }
+        if (scanned->kind == UL_COMB_Stack) {
+            /* segments shared by several records are scanned again, which
+             * finds everything already copied */
+            for (size_t i = 0; i < UL_STACK_NSEGS(scanned); i++) {
+                UL_STACK_SEG(scanned, i)->mark = ctx->gc_epoch;
+                gc_scan_stack(ctx, UL_STACK_LO(scanned, i), UL_STACK_TOP(scanned, i));
+            }
+        }
+        scanp += ul_closure_size(scanned->env.n_captured);
+    }
+swap:
+    UL_STATS_ADD(ctx, gc_copied, ctx->gc_allocp - ctx->gc_to);
+    gc_swap(ctx);
+}
+
+/* Drop the heap and the stack of a run, keeping the code compiled so far.
+ * Nothing compiled points into either. */
+void ul_ctx_reset(ul_ctx_t *ctx) {
+    ul_seg_t *seg = ctx->seg;
+
+    while (seg->prev) {
+        seg = seg->prev;
+    }
+    seg->next = NULL;
+    seg->frozen = 0;
+    seg->lo = seg->base;
+    seg->mark = ++ctx->gc_epoch;
+    ctx->seg = seg;
+    ctx->sp = seg->base;
+    ctx->below = NULL;
+    ctx->below_i = 0;
+    ctx->below_top = NULL;
+    ctx->gc_allocp = ctx->gc_from;
+    ctx->gc_scanp = NULL;
+    ctx->gc_ranges.size = 0;
+    /* an idle context keeps next to nothing resident */
+    ul_heap_release(ctx, ctx->gc_from, ctx->gc_from + ctx->heap_size);
+    ul_heap_release(ctx, ctx->gc_to, ctx->gc_to + ctx->heap_size);
+    ctx->heap_size = ul_heap_min(ctx);
+    UL_STATS_MAX(ctx, heap_peak, ctx->heap_size);
+    ctx->gc_live = 0;
+    ctx->fuel = LONG_MAX;
+    ctx->rt_val = NULL;
+    ctx->rt_pc = NULL;
+    ctx->rt_nargs = 0;
+    ctx->rt_in_bc = 0;
+    gc_sweep_stack(ctx);
+    gc_set_limit(ctx);
+}
+
+/* Make room for size bytes at gc_allocp. Returns -1 if the heap is full of
+ * live data. */
+static int gc_reserve(ul_ctx_t *ctx, size_t size) {
+    uint64_t start = ul_now_ns();
+
+    UL_STATS_STACK(ctx, ctx->sp);
+    if (ctx->gc_scanp) {
+        gc_incr_step(ctx, size);
+    } else if (ctx->gc_pause) {
+        gc_incr_start(ctx);
+        if (ctx->gc_room < size) {
+            gc_incr_finish(ctx);
+        }
+    }
+    if (!ctx->gc_scanp && ctx->gc_allocp + size > ctx->gc_from + ctx->heap_size) {
+        gc(ctx);
+        if (ctx->gc_allocp + size > ctx->gc_from + ctx->heap_size) {
+            gc_resize(ctx, size);
+            gc_set_limit(ctx);
+        }
+    }
+    ul_pause(ctx, start);
+    return ctx->gc_scanp || ctx->gc_allocp + size <= ctx->gc_from + ctx->heap_size ? 0 : -1;
+}
+
+ul_closure_t *ul_alloc(ul_ctx_t *ctx, size_t n_args) {
+    size_t size = ul_closure_size(n_args);
+    if (ctx->gc_allocp + size > ctx->gc_limit && gc_reserve(ctx, size) < 0) {
+        return NULL;
+    }
+    ul_closure_t *new = (ul_closure_t *) ctx->gc_allocp;
+    ctx->gc_allocp += size;
+    new->fwd = NULL;
+    UL_STATS_ADD(ctx, alloc_objects, 1);
+    UL_STATS_ADD(ctx, alloc_bytes, size);
+    return new;
+}
+
+/* The compiler.
+ *
+ * Every unit is the code of one subterm, ending in ret (or hlt for the whole
+ * program). Applications are evaluated inline, but non-atomic arguments are
+ * left as stub instructions behind the unit and only compiled the first time
+ * they are called or forced. A delayed argument that is never forced, or an
+ * argument of code that never runs, is never compiled at all.
+ *
+ * Arguments are pushed last one first so the first argument ends up on top.
+ * Evaluating an atom has no effect, so the atoms following a non-atomic
+ * argument are batched into the same application.
+ *
+ * Partial applications that cannot escape are not built at all. Short of
+ * saturation, s and k applied to the operands at the head of the spine of an
+ * application are only ever applied to the next operand, so those operands
+ * are evaluated onto the stack in order and the combinator gets them at once.
+ * Likewise the promise of ``dFX is only ever forced by X, so X is evaluated
+ * first and then F applied to it.
+ */
+static ul_closure_t *ul_const(ul_ctx_t *ctx, ul_atom_t atom) {
+    ul_closure_t *clos;
+    switch (atom) {
+    case UL_S: return &ul_S;
+    case UL_K: return &ul_K;
+    case UL_I: return &ul_I;
+    case UL_V: return &ul_V;
+    case UL_C: return &ul_C;
+    case UL_D: return &ul_D;
+    }
+    if (!(clos = ctx->dots[(uint8_t) atom])) {
+        if (!(clos = malloc(ul_closure_size(1)))) {
+            return NULL;
+        }
+        clos->kind = UL_COMB_Dot;
+        clos->arity = 2;
+        clos->fwd = NULL;
+        clos->env.n_captured = 1;
+        clos->env.captured[0] = (ul_closure_t *) UL_IMM((uint8_t) atom);
+        ctx->dots[(uint8_t) atom] = clos;
+    }
+    return clos;
+}
+
+static int ul_emit(dynbuf_t *bc, uint8_t op) {
+    return dynbuf_put_uint8_t(bc, op);
+}
+
+static int ul_emit1(dynbuf_t *bc, uint8_t op, size_t operand) {
+    if (dynbuf_put_uint8_t(bc, op) < 0) {
+        return -1;
+    }
+    return dynbuf_put_size_t(bc, operand);
+}
+
+static int ul_emit_const(ul_ctx_t *ctx, uint8_t op, ul_atom_t atom) {
+    ul_closure_t *clos = ul_const(ctx, atom);
+    if (!clos) {
+        return -1;
+    }
+    return ul_emit1(&ctx->ul_bc, op, (size_t) clos);
+}
+
+/* Emit op with a unit operand, to be resolved once the current unit ends. */
+static int ul_emit_unit(ul_ctx_t *ctx, uint8_t op, ul_ast_t *ast, dynbuf_t *pending) {
+    if (dynbuf_put_size_t(pending, dynbuf_size(&ctx->ul_bc) + 1) < 0 ||
+        dynbuf_put_size_t(pending, (size_t) ast) < 0) {
+        return -1;
+    }
+    return ul_emit1(&ctx->ul_bc, op, 0);
+}
+
+/* Evaluate an argument whose operator is known not to be d onto the stack. */
+static int ul_emit_push(ul_ctx_t *ctx, ul_ast_t *ast, dynbuf_t *pending) {
+    if (ul_ast_is_atom(ast)) {
+        return ul_emit_const(ctx, push1, ast->u.atom);
+    }
+    if (ul_emit_unit(ctx, call, ast, pending) < 0) {
+        return -1;
+    }
+    return ul_emit(&ctx->ul_bc, push);
+}
+
+/* The number of arguments from rands[i] on that go into one application. */
+static size_t ul_batch_size(ul_ast_t *ast, size_t i) {
+    size_t n = 1;
+    while (i + n < ast->nrands && ul_ast_is_atom(ast->rands[i + n])) {
+        n++;
+    }
+    return n;
+}
+
+static int ul_compile_expr(ul_ctx_t *ctx, ul_ast_t *ast, dynbuf_t *pending) {
+    dynbuf_t *bc = &ctx->ul_bc;
+    ul_ast_t *rator;
+    size_t i = 0, n, m;
+
+    if (ul_ast_is_atom(ast)) {
+        return ul_emit_const(ctx, ld, ast->u.atom);
+    }
+    rator = ast->u.rator;
+    if (ul_ast_is_atom(rator) && rator->u.atom <= UL_S && rator->u.atom >= UL_I) {
+        /* s, k and i are never d, so the first argument can be evaluated
+         * without looking at the operator */
+        n = ul_batch_size(ast, 0);
+        m = rator->u.atom == UL_S ? 3 : rator->u.atom == UL_K ? 2 : 1;
+        m = m < ast->nrands ? m : ast->nrands;
+        if (n < m) {
+            /* the partial applications in between would not escape */
+            for (n = 0; n < m; n++) {
+                if (ul_emit_push(ctx, ast->rands[n], pending) < 0) {
+                    return -1;
+                }
+            }
+            if (ul_emit1(bc, rev, m) < 0) {
+                return -1;
+            }
+        } else {
+            for (size_t j = n - 1; j > 0; j--) {
+                if (ul_emit_const(ctx, push1, ast->rands[j]->u.atom) < 0) {
+                    return -1;
+                }
+            }
+            if (ul_emit_push(ctx, ast->rands[0], pending) < 0) {
+                return -1;
+            }
+        }
+        if (ul_emit1(bc, apply_S + UL_S - rator->u.atom, n) < 0) {
+            return -1;
+        }
+        i = n;
+    } else if (ul_ast_is_atom(rator) && rator->u.atom == UL_D && ul_ast_is_app(ast->rands[0]) && ast->nrands > 1) {
+        /* ``dFX is `FX with X evaluated first */
+        n = ul_batch_size(ast, 1);
+        for (size_t j = n; j > 1; j--) {
+            if (ul_emit_const(ctx, push1, ast->rands[j]->u.atom) < 0) {
+                return -1;
+            }
+        }
+        if (ul_emit_push(ctx, ast->rands[1], pending) < 0 ||
+            ul_emit_unit(ctx, call, ast->rands[0], pending) < 0 || ul_emit1(bc, apply_unk, n) < 0 ||
+            dynbuf_put_size_t(bc, 0) < 0) {
+            return -1;
+        }
+        i = 1 + n;
+    } else if (ul_ast_is_atom(rator) && rator->u.atom == UL_D && ul_ast_is_app(ast->rands[0])) {
+        if (ul_emit_unit(ctx, promise, ast->rands[0], pending) < 0) {
+            return -1;
+        }
+        i = 1;
+    } else if (ul_compile_expr(ctx, rator, pending) < 0) {
+        return -1;
+    }
+    while (i < ast->nrands) {
+        n = ul_batch_size(ast, i);
+        for (size_t j = i + n - 1; j > i; j--) {
+            if (ul_emit_const(ctx, push1, ast->rands[j]->u.atom) < 0) {
+                return -1;
+            }
+        }
+        if (ul_ast_is_atom(ast->rands[i])) {
+            if (ul_emit_const(ctx, push1, ast->rands[i]->u.atom) < 0) {
+                return -1;
+            }
+        } else if (ul_emit(bc, push) < 0 || ul_emit_unit(ctx, dcall, ast->rands[i], pending) < 0 ||
+                   ul_emit(bc, swap) < 0) {
+            return -1;
+        }
+        /* the inline cache is assigned by ul_peephole */
+        if (ul_emit1(bc, apply_unk, n) < 0 || dynbuf_put_size_t(bc, 0) < 0) {
+            return -1;
+        }
+        i += n;
+    }
+    return 0;
+}
+
+/* Polymorphic inline caches.
+ *
+ * Every application of an unknown operator has a cache recording the shapes,
+ * combinator and number of captured arguments, of the closures it applied,
+ * together with the handler for that shape and the site's argument count.
+ * After UL_IC_WAYS different shapes the site is megamorphic and always
+ * takes the generic path.
+ */
+#define UL_IC_WAYS 4
+#define UL_IC_MEGA 0xff
+#define UL_IC_SHAPE(clos) (((clos)->kind << 2) | (clos)->env.n_captured)
+
+enum {
+    UL_IC_GENERIC,
+    UL_IC_PARTIAL,
+    UL_IC_K,
+    UL_IC_I,
+    UL_IC_V,
+    UL_IC_DOT,
+    UL_IC_S,
+};
+
+typedef struct {
+    uint8_t n;
+    uint8_t handler[UL_IC_WAYS];
+    uint16_t shape[UL_IC_WAYS];
+} ul_ic_t;
+
+static size_t ul_ic_new(ul_ctx_t *ctx) {
+    ul_ic_t ic = { 0 };
+    size_t slot = dynbuf_size(&ctx->ul_ics) / sizeof(ul_ic_t);
+    if (dynbuf_put(&ctx->ul_ics, (uint8_t *) &ic, sizeof(ic)) < 0) {
+        return -1;
+    }
+    return slot;
+}
+
+static int ul_ic_handler(ul_closure_t *clos, size_t nargs) {
+    size_t need = clos->arity - clos->env.n_captured;
+    if (nargs < need) {
+        return UL_IC_PARTIAL;
+    } else if (nargs > need) {
+        return UL_IC_GENERIC;
+    }
+    switch (clos->kind) {
+    case UL_COMB_K: return UL_IC_K;
+    case UL_COMB_I: return UL_IC_I;
+    case UL_COMB_V: return UL_IC_V;
+    case UL_COMB_Dot: return UL_IC_DOT;
+    case UL_COMB_S: return UL_IC_S;
+    }
+    return UL_IC_GENERIC;
+}
+
+/* A partial application of a combinator to constants, kept out of the heap
+ * like the atoms. */
+static ul_closure_t *ul_const_app(ul_ctx_t *ctx, ul_closure_t *comb, size_t n, size_t *args) {
+    ul_closure_t *clos = malloc(ul_closure_size(n));
+    if (!clos) {
+        return NULL;
+    }
+    if (dynbuf_put(&ctx->ul_consts, (uint8_t *) &clos, sizeof(clos)) < 0) {
+        free(clos);
+        return NULL;
+    }
+    clos->kind = comb->kind;
+    clos->arity = comb->arity;
+    clos->fwd = NULL;
+    clos->env.n_captured = n;
+    for (size_t i = 0; i < n; i++) {
+        clos->env.captured[i] = (ul_closure_t *) args[i];
+    }
+    return clos;
+}
+
+typedef struct {
+    uint8_t op;
+    size_t operand[2];
+    size_t pending; /* offset of the pending entry for operand[0], or -1 */
+} ul_insn_t;
+
+#define UL_INSN(code, i) (((ul_insn_t *) (code)->data)[i])
+#define UL_NINSN(code) (dynbuf_size(code) / sizeof(ul_insn_t))
+
+/* The number of push1 right before the instruction at n. */
+static size_t ul_peep_npush1(dynbuf_t *code, size_t n) {
+    size_t c = 0;
+    while (c < n && UL_INSN(code, n - c - 1).op == push1) {
+        c++;
+    }
+    return c;
+}
+
+/* Rewrite the tail of code after an instruction has been appended, returns
+ * 1 if it changed, 0 if not and -1 on error. */
+static int ul_peep_rewrite(ul_ctx_t *ctx, dynbuf_t *code) {
+    size_t n = UL_NINSN(code), nargs, args[2];
+    ul_insn_t *last, *prev;
+    ul_closure_t *clos;
+
+    if (n < 2) {
+        return 0;
+    }
+    last = &UL_INSN(code, n - 1);
+    prev = &UL_INSN(code, n - 2);
+    nargs = last->operand[0];
+    if (prev->op == push && last->op == apply_I) {
+        /* `iX is X */
+        code->size -= (nargs == 1 ? 2 : 1) * sizeof(ul_insn_t);
+        if (nargs > 1) {
+            *prev = (ul_insn_t) { apply_unk, { nargs - 1 }, -1 };
+        }
+        return 1;
+    }
+    if (prev->op == push1 && last->op == apply_I) {
+        *prev = (ul_insn_t) { ld, { prev->operand[0] }, -1 };
+        if (nargs > 1) {
+            *last = (ul_insn_t) { apply_unk, { nargs - 1 }, -1 };
+        } else {
+            code->size -= sizeof(ul_insn_t);
+        }
+        return 1;
+    }
+    if (last->op == apply_K && nargs >= 2 && ul_peep_npush1(code, n - 1) >= 2) {
+        /* ``kXY is X, with Y already evaluated */
+        UL_INSN(code, n - 3) = (ul_insn_t) { ld, { prev->operand[0] }, -1 };
+        code->size -= (nargs == 2 ? 2 : 1) * sizeof(ul_insn_t);
+        if (nargs > 2) {
+            UL_INSN(code, n - 2) = (ul_insn_t) { apply_unk, { nargs - 2 }, -1 };
+        }
+        return 1;
+    }
+    if ((last->op == apply_K || last->op == apply_S) && nargs < (last->op == apply_K ? 2 : 3) &&
+        ul_peep_npush1(code, n - 1) >= nargs) {
+        /* a constant partial application */
+        for (size_t i = 0; i < nargs; i++) {
+            args[i] = UL_INSN(code, n - 2 - i).operand[0];
+        }
+        if (!(clos = ul_const_app(ctx, last->op == apply_K ? &ul_K : &ul_S, nargs, args))) {
+            return -1;
+        }
+        code->size -= nargs * sizeof(ul_insn_t);
+        UL_INSN(code, n - 1 - nargs) = (ul_insn_t) { ld, { (size_t) clos }, -1 };
+        return 1;
+    }
+    if (prev->op == rev && last->op == apply_K && nargs == 2) {
+        /* ``kXY with both on the stack in order */
+        *prev = (ul_insn_t) { pop, { 0 }, -1 };
+        *last = (ul_insn_t) { pop, { 0 }, -1 };
+        return 1;
+    }
+    if (prev->op == push && last->op == pop) {
+        code->size -= 2 * sizeof(ul_insn_t);
+        return 1;
+    }
+    if (prev->op == push1 && last->op == apply_unk && nargs == 1) {
+        *prev = (ul_insn_t) { apply1, { prev->operand[0], 0 }, -1 };
+        code->size -= sizeof(ul_insn_t);
+        return 1;
+    }
+    if (prev->op == push && last->op == dcall) {
+        *prev = (ul_insn_t) { pdcall, { last->operand[0] }, last->pending };
+        code->size -= sizeof(ul_insn_t);
+        return 1;
+    }
+    if (prev->op == swap && last->op == apply_unk) {
+        *prev = (ul_insn_t) { swap_apply, { nargs, 0 }, -1 };
+        code->size -= sizeof(ul_insn_t);
+        return 1;
+    }
+    if (last->op == ret && prev->op >= apply_S && prev->op <= apply_I) {
+        /* a known combinator in tail position goes through ld */
+        clos = prev->op == apply_S ? &ul_S : prev->op == apply_K ? &ul_K : &ul_I;
+        *last = (ul_insn_t) { tapply_unk, { prev->operand[0], 0 }, -1 };
+        *prev = (ul_insn_t) { ld, { (size_t) clos }, -1 };
+        return 1;
+    }
+    if (last->op == ret && (prev->op == apply_unk || prev->op == apply1 || prev->op == swap_apply)) {
+        prev->op = prev->op == apply_unk ? tapply_unk : prev->op == apply1 ? tapply1 : tswap_apply;
+        code->size -= sizeof(ul_insn_t);
+        return 1;
+    }
+    return 0;
+}
+
+/* Peephole pass over the unit from start to the end of the buffer, keeping
+ * the operand offsets in pending up to date. */
+static int ul_peephole(ul_ctx_t *ctx, size_t start, dynbuf_t *pending) {
+    dynbuf_t *bc = &ctx->ul_bc, code;
+    size_t pos = start, p = 0, np = dynbuf_size(pending), off;
+    ul_insn_t insn;
+    int rc;
+
+    dynbuf_init(&code);
+    while (pos < dynbuf_size(bc)) {
+        insn.op = bc->data[pos++];
+        insn.pending = -1;
+        if (p < np && memcmp(pending->data + p, &pos, sizeof(pos)) == 0) {
+            insn.pending = p;
+            p += 2 * sizeof(size_t);
+        }
+        for (int i = 0; i < ul_op_noperands[insn.op]; i++) {
+            memcpy(&insn.operand[i], bc->data + pos, sizeof(size_t));
+            pos += sizeof(size_t);
+        }
+        if (dynbuf_put(&code, (uint8_t *) &insn, sizeof(insn)) < 0) {
+            goto error;
+        }
+        while ((rc = ul_peep_rewrite(ctx, &code)) > 0) {
+        }
+        if (rc < 0) {
+            goto error;
+        }
+    }
+    bc->size = start;
+    for (size_t i = 0; i < UL_NINSN(&code); i++) {
+        insn = UL_INSN(&code, i);
+        if (insn.op == push1 && i + 1 < UL_NINSN(&code) && UL_INSN(&code, i + 1).op == push1) {
+            insn = (ul_insn_t) { push2, { insn.operand[0], UL_INSN(&code, i + 1).operand[0] }, -1 };
+            i++;
+        }
+        if ((insn.op == apply_unk || insn.op == apply1 || insn.op == swap_apply || insn.op == tapply_unk ||
+             insn.op == tapply1 || insn.op == tswap_apply) &&
+            (insn.operand[1] = ul_ic_new(ctx)) == (size_t) -1) {
+            goto error;
+        }
+        if (ul_emit(bc, insn.op) < 0) {
+            goto error;
+        }
+        if (insn.pending != (size_t) -1) {
+            off = dynbuf_size(bc);
+            memcpy(pending->data + insn.pending, &off, sizeof(off));
+        }
+        for (int j = 0; j < ul_op_noperands[insn.op]; j++) {
+            if (dynbuf_put_size_t(bc, insn.operand[j]) < 0) {
+                goto error;
+            }
+        }
+    }
+    dynbuf_free(&code);
+    return 0;
+error:
+    dynbuf_free(&code);
+    return -1;
+}
+
+/* Compile ast as a new unit terminated by last_op, returns its offset. */
+static ssize_t ul_compile(ul_ctx_t *ctx, ul_ast_t *ast, uint8_t last_op) {
+    dynbuf_t *bc = &ctx->ul_bc, pending;
+    size_t start = dynbuf_size(bc), pos, stub_off;
+    ul_ast_t *sub;
+
+    dynbuf_init(&pending);
+    if (ul_compile_expr(ctx, ast, &pending) < 0 || ul_emit(bc, last_op) < 0 ||
+        ul_peephole(ctx, start, &pending) < 0) {
+        goto error;
+    }
+    for (size_t i = 0; i < dynbuf_size(&pending); i += 2 * sizeof(size_t)) {
+        memcpy(&pos, pending.data + i, sizeof(pos));
+        memcpy(&sub, pending.data + i + sizeof(pos), sizeof(sub));
+        stub_off = dynbuf_size(bc);
+        if (ul_emit1(bc, stub, (size_t) sub) < 0 || dynbuf_put_size_t(bc, pos) < 0) {
+            goto error;
+        }
+        memcpy(bc->data + pos, &stub_off, sizeof(stub_off));
+    }
+#ifdef UL_UNITS
+    if (dynbuf_put_size_t(&ctx->ul_units, start) < 0 || dynbuf_put_size_t(&ctx->ul_units, (size_t) ast) < 0) {
+        goto error;
+    }
+#endif
+    dynbuf_free(&pending);
+    return start;
+error:
+    dynbuf_free(&pending);
+    return -1;
+}
+
+/* The interpreter.
+ *
+ * The VM registers live in a ul_regs_t local to ul_run. Every instruction is
+ * a handler function over the registers, returning what to do next. With
+ * switch or direct threaded dispatch the handlers and the apply/return
+ * machinery are inlined into ul_run, so the registers end up in machine
+ * registers; they are only spilled to ul_ctx_t around the GC and the
+ * compiler. With CALL_THREADING the handlers are called through a table.
+ */
+typedef struct {
+    uint8_t *pc;
+    ul_value_t *sp;
+    ul_closure_t *acc; /* the cached top of stack, rt_val of ul_ctx_t */
+    ul_value_t *base;  /* the bounds of ctx->seg */
+    ul_value_t *limit;
+    size_t nargs;
+    int in_bc;         /* 0 while popping continuation frames */
+    long fuel;         /* only checked by ul_engine, see below */
+    ul_ctx_t *ctx;
+} ul_regs_t;
+
+enum {
+    UL_NEXT,    /* go on with the bytecode */
+    UL_APPLY,   /* apply acc to nargs values on the stack */
+    UL_RET,     /* return to the continuation frame on top of the stack */
+    UL_HALT,
+    UL_SUSPEND, /* out of fuel, about to apply acc to nargs values */
+};
+
+#ifdef CALL_THREADING
+#define UL_HANDLER static __attribute__((noinline))
+#else
+#define UL_HANDLER static inline __attribute__((always_inline))
+#endif
+
+/* Segment switches. sp never rests on the lo of a segment unless the stack
+ * is empty, so the top of the stack is always at sp[-1]. */
+static ul_seg_t *ul_stack_next(ul_ctx_t *ctx) {
+    ul_seg_t *seg = ctx->seg, *next = seg->next;
+    size_t size;
+
+    if (!next) {
+        size = 2 * ((uint8_t *) seg->limit - (uint8_t *) seg->base);
+        if (size > UL_STACK_SEG_MAX) {
+            size = UL_STACK_SEG_MAX;
+        }
+        if (!(next = ul_seg_new(ctx, size))) {
+            ul_abort(ctx, UL_RUN_STACK);
+        }
+        seg->next = next;
+    }
+    next->lo = next->base;
+    return next;
+}
+
+static __attribute__((noinline)) void ul_stack_overflow(ul_regs_t *r) {
+    ul_seg_t *next;
+
+    UL_STATS_STACK(r->ctx, r->sp);
+    next = ul_stack_next(r->ctx);
+
+    next->prev = r->ctx->seg;
+    r->ctx->seg = next;
+    r->sp = r->base = next->lo;
+    r->limit = next->limit;
+}
+
+/* Copy the top of the frozen stack into the bottom segment, which is empty. */
+static void ul_stack_thaw(ul_regs_t *r) {
+    ul_ctx_t *ctx = r->ctx;
+    ul_closure_t *rec = ctx->below;
+    ul_value_t *lo = UL_STACK_LO(rec, ctx->below_i), *top = ctx->below_top;
+    size_t n = top - lo < UL_THAW_SIZE ? top - lo : UL_THAW_SIZE;
+
+    top -= n;
+    memcpy(r->sp, top, n * sizeof(ul_value_t));
+    r->sp += n;
+    if (top > lo) {
+        ctx->below_top = top;
+    } else if (ctx->below_i > 0) {
+        ctx->below_i--;
+        ctx->below_top = UL_STACK_TOP(rec, ctx->below_i);
+    } else {
+        ctx->below = rec->env.captured[0];
+        ctx->below_i = UL_IMM_VAL(rec->env.captured[1]);
+        ctx->below_top = (ul_value_t *) rec->env.captured[2];
+    }
+}
+
+static __attribute__((noinline)) void ul_stack_underflow(ul_regs_t *r) {
+    ul_ctx_t *ctx = r->ctx;
+    ul_seg_t *seg = ctx->seg, *prev = seg->prev;
+
+    if (prev) {
+        prev->next = seg->frozen ? NULL : seg;
+        ctx->seg = prev;
+        r->base = prev->lo;
+        r->sp = r->limit = prev->limit;
+    } else if (ctx->below) {
+        ul_stack_thaw(r);
+    }
+}
+
+static inline __attribute__((always_inline)) void ul_push(ul_regs_t *r, ul_value_t val) {
+    if (__builtin_expect(r->sp == r->limit, 0)) {
+        ul_stack_overflow(r);
+    }
+    *r->sp++ = val;
+}
+
+static inline __attribute__((always_inline)) ul_value_t ul_pop(ul_regs_t *r) {
+    ul_value_t val;
+    assert(r->sp > r->base);
+    val = *(--r->sp);
+    if (__builtin_expect(r->sp == r->base, 0)) {
+        ul_stack_underflow(r);
+    }
+    return val;
+}
+
+static inline __attribute__((always_inline)) void ul_drop(ul_regs_t *r, size_t n) {
+    if (__builtin_expect((size_t) (r->sp - r->base) > n, 1)) {
+        r->sp -= n;
+        return;
+    }
+    while (n--) {
+        ul_pop(r);
+    }
+}
+
+/* Slide the top n values up to make room for a RET frame below them. */
+static __attribute__((noinline)) void ul_stack_insert_ret(ul_regs_t *r, size_t n, size_t off) {
+    ul_value_t *vals;
+
+    if ((size_t) (r->sp - r->base) >= n && r->limit - r->sp >= 2) {
+        memmove(r->sp - n + 2, r->sp - n, n * sizeof(ul_value_t));
+        r->sp[-n] = UL_IMM(off);
+        r->sp[-n + 1] = UL_FRAME_RET;
+        r->sp += 2;
+        return;
+    }
+    if (!(vals = malloc(n * sizeof(ul_value_t)))) {
+        ul_abort(r->ctx, UL_RUN_OOM);
+    }
+    for (size_t i = 0; i < n; i++) {
+        vals[i] = ul_pop(r);
+    }
+    ul_push(r, UL_IMM(off));
+    ul_push(r, UL_FRAME_RET);
+    while (n--) {
+        ul_push(r, vals[n]);
+    }
+    free(vals);
+}
+
+#ifdef UL_TRACE
+/* Reduction trace, with -DUL_TRACE: see ul_trace_start. */
+static ul_trace_rec_t *ul_trace_drain(ul_ctx_t *ctx);
+
+static inline __attribute__((always_inline)) void ul_trace(ul_regs_t *r, ul_closure_t *clos) {
+    ul_ctx_t *ctx = r->ctx;
+    ul_trace_rec_t *rec = ctx->trace_p;
+
+    if (!rec || (rec == ctx->trace_end && !(rec = ul_trace_drain(ctx)))) {
+        return;
+    }
+    rec->pc = r->pc - ctx->ul_bc.data;
+    rec->kind = clos->kind;
+    rec->arity = clos->arity - clos->env.n_captured;
+    rec->nargs = r->nargs < 255 ? r->nargs : 255;
+    rec->gc = ctx->gc_epoch;
+    rec->alloc = ctx->gc_allocp - ctx->gc_from;
+    ctx->trace_p = rec + 1;
+}
+#define UL_TRACE_APPLY(r, clos) ul_trace(r, clos)
+#else
+#define UL_TRACE_APPLY(r, clos) ((void) 0)
+#endif
+
+static inline __attribute__((always_inline)) size_t ul_operand(ul_regs_t *r) {
+    size_t operand;
+    memcpy(&operand, r->pc, sizeof(operand));
+    r->pc += sizeof(operand);
+    return operand;
+}
+
+static inline __attribute__((always_inline)) ul_closure_t *ul_regs_alloc(ul_regs_t *r, size_t n_args) {
+    ul_closure_t *new;
+    r->ctx->sp = r->sp;
+    r->ctx->rt_val = r->acc;
+    if (!(new = ul_alloc(r->ctx, n_args))) {
+        ul_abort(r->ctx, UL_RUN_OOM);
+    }
+    UL_SITE_SET(new, r->pc - r->ctx->ul_bc.data);
+    r->acc = r->ctx->rt_val;
+    return new;
+}
+
+#define PC_OFF(r) ((size_t) ((r)->pc - (r)->ctx->ul_bc.data))
+
+/* Freeze the running stack into a continuation for c. The segments of the
+ * running stack are shared with the record from then on, so capturing costs
+ * one allocation whatever the depth. The running stack starts over above
+ * them, and ul_stack_thaw copies values back UL_THAW_SIZE at a time as it
+ * returns into them. The function applied by c is kept in acc. */
+static ul_closure_t *ul_stack_capture(ul_regs_t *r) {
+    ul_ctx_t *ctx = r->ctx;
+    ul_seg_t *seg;
+    ul_closure_t *rec, *k;
+    size_t nsegs = 0, n;
+
+    /* reclaim the segments of dead continuations, at the flip of the
+     * incremental cycle under way unless they pile up meanwhile */
+    if (ctx->stack_mapped > ctx->stack_gc_at &&
+        (!ctx->gc_scanp || ctx->stack_mapped > 4 * ctx->stack_gc_at)) {
+        uint64_t start = ul_now_ns();
+        ctx->sp = r->sp;
+        ctx->rt_val = r->acc;
+        if (ctx->gc_pause && !ctx->gc_scanp) {
+            gc_incr_start(ctx);
+        } else {
+            gc(ctx);
+        }
+        ul_pause(ctx, start);
+        r->acc = ctx->rt_val;
+    }
+    for (seg = ctx->seg; seg; seg = seg->prev) {
+        nsegs++;
+    }
+    /* the record and the continuation are allocated as one block */
+    n = 3 + 3 * nsegs;
+    rec = ul_regs_alloc(r, n + sizeof(ul_closure_t) / sizeof(ul_closure_t *) + 1);
+    k = (ul_closure_t *) ((uint8_t *) rec + ul_closure_size(n));
+    rec->kind = UL_COMB_Stack;
+    rec->arity = 0;
+    rec->env.n_captured = n;
+    rec->env.captured[0] = ctx->below;
+    rec->env.captured[1] = (ul_closure_t *) UL_IMM(ctx->below_i);
+    rec->env.captured[2] = (ul_closure_t *) ctx->below_top;
+    for (seg = ctx->seg; seg; seg = seg->prev) {
+        nsegs--;
+        assert((seg == ctx->seg ? r->sp : seg->limit) > seg->lo);
+        seg->frozen = 1;
+        rec->env.captured[3 + 3 * nsegs] = (ul_closure_t *) seg;
+        rec->env.captured[4 + 3 * nsegs] = (ul_closure_t *) seg->lo;
+        rec->env.captured[5 + 3 * nsegs] = (ul_closure_t *) (seg == ctx->seg ? r->sp : seg->limit);
+    }
+    k->kind = UL_COMB_Cont;
+    k->arity = UL_ARITY_Cont;
+    UL_SITE_SET(k, rec->site);
+    k->fwd = NULL;
+    k->env.n_captured = 1;
+    k->env.captured[0] = rec;
+
+    ctx->below = rec;
+    ctx->below_i = UL_STACK_NSEGS(rec) - 1;
+    ctx->below_top = r->sp;
+    seg = ctx->seg;
+    if (seg->limit - r->sp < UL_THAW_SIZE) {
+        ctx->seg = seg = ul_stack_next(ctx);
+    } else {
+        seg->lo = r->sp;
+    }
+    seg->prev = NULL;
+    r->sp = r->base = seg->lo;
+    r->limit = seg->limit;
+    return k;
+}
+
+/* Throw away the running stack for the frozen one in rec. The bottom
+ * segment of the running stack is kept to thaw it into. */
+static void ul_stack_restore(ul_regs_t *r, ul_closure_t *rec) {
+    ul_ctx_t *ctx = r->ctx;
+    ul_seg_t *seg = ctx->seg;
+
+    while (seg->prev) {
+        seg = seg->prev;
+    }
+    ctx->seg = seg;
+    ctx->below = rec;
+    ctx->below_i = UL_STACK_NSEGS(rec) - 1;
+    ctx->below_top = UL_STACK_TOP(rec, ctx->below_i);
+    r->sp = r->base = seg->lo;
+    r->limit = seg->limit;
+    ul_stack_thaw(r);
+}
+
+/* Capture the nargs values on top of the stack into a copy of acc. */
+static inline __attribute__((always_inline)) void ul_apply_partial(ul_regs_t *r) {
+    ul_closure_t *clos, *new;
+    size_t m = r->acc->env.n_captured;
+
+    new = ul_regs_alloc(r, m + r->nargs);
+    clos = r->acc;
+    new->kind = clos->kind;
+    new->arity = clos->arity;
+    new->env.n_captured = m + r->nargs;
+    memcpy(new->env.captured, clos->env.captured, m * sizeof(ul_closure_t *));
+    for (size_t i = m; i < m + r->nargs; i++) {
+        new->env.captured[i] = (ul_closure_t *) ul_pop(r);
+    }
+    r->acc = new;
+}
+
+/* Set out on Sxyz = xz(yz) once any frame below it is pushed. When x needs
+ * two more arguments or more, xz can only be a partial application that S3
+ * applies right away, so it is skipped: x gets z and yz together. */
+static inline __attribute__((always_inline)) void ul_enter_S(ul_regs_t *r, ul_value_t *args) {
+    ul_closure_t *x = (ul_closure_t *) args[0];
+
+    ul_push(r, args[2]);
+    if (x->arity - x->env.n_captured >= 2) {
+        ul_push(r, args[0]);
+        ul_push(r, UL_FRAME_S3);
+        r->acc = (ul_closure_t *) args[1];
+    } else {
+        ul_push(r, args[1]);
+        ul_push(r, UL_FRAME_S1);
+        r->acc = x;
+    }
+    ul_push(r, args[2]);
+    r->nargs = 1;
+}
+
+/* Apply acc to nargs values through the inline cache at slot. The cached
+ * handlers cover the applications that finish without a continuation frame,
+ * and saturating S, which goes straight to evaluating xz. A tail application
+ * returns to the frame below the arguments rather than to the bytecode. */
+static inline __attribute__((always_inline)) int ul_apply_ic(ul_regs_t *r, size_t slot, int tail) {
+    ul_ic_t *ic = &((ul_ic_t *) r->ctx->ul_ics.data)[slot];
+    ul_closure_t *clos = r->acc;
+    unsigned shape = UL_IC_SHAPE(clos);
+    ul_value_t args[3];
+    size_t m, i;
+    int h;
+
+    if (tail) {
+        r->in_bc = 0;
+    }
+    if (ic->n == UL_IC_MEGA) {
+        return UL_APPLY;
+    }
+    for (i = 0; i < ic->n; i++) {
+        if (ic->shape[i] == shape) {
+            break;
+        }
+    }
+    if (i == ic->n) {
+        if (ic->n == UL_IC_WAYS) {
+            ic->n = UL_IC_MEGA;
+            return UL_APPLY;
+        }
+        ic->shape[i] = shape;
+        ic->handler[i] = ul_ic_handler(clos, r->nargs);
+        ic->n++;
+    }
+    h = ic->handler[i];
+    switch (h) {
+    case UL_IC_PARTIAL:
+        r->fuel--;
+        UL_TRACE_APPLY(r, clos);
+        UL_STATS_ADD(r->ctx, partial, 1);
+        ul_apply_partial(r);
+        return tail ? UL_RET : UL_NEXT;
+    case UL_IC_K:
+        r->fuel--;
+        UL_TRACE_APPLY(r, clos);
+        UL_STATS_ADD(r->ctx, reductions[UL_COMB_K], 1);
+        r->acc = clos->env.n_captured ? clos->env.captured[0] : (ul_closure_t *) ul_pop(r);
+        ul_pop(r);
+        return tail ? UL_RET : UL_NEXT;
+    case UL_IC_I:
+        r->fuel--;
+        UL_TRACE_APPLY(r, clos);
+        UL_STATS_ADD(r->ctx, reductions[UL_COMB_I], 1);
+        r->acc = (ul_closure_t *) ul_pop(r);
+        return tail ? UL_RET : UL_NEXT;
+    case UL_IC_V:
+        r->fuel--;
+        UL_TRACE_APPLY(r, clos);
+        UL_STATS_ADD(r->ctx, reductions[UL_COMB_V], 1);
+        ul_drop(r, r->nargs);
+        return tail ? UL_RET : UL_NEXT;
+    case UL_IC_DOT:
+        r->fuel--;
+        UL_TRACE_APPLY(r, clos);
+        UL_STATS_ADD(r->ctx, reductions[UL_COMB_Dot], 1);
+        putc(UL_IMM_VAL(clos->env.captured[0]), r->ctx->out);
+        r->acc = (ul_closure_t *) ul_pop(r);
+        return tail ? UL_RET : UL_NEXT;
+    case UL_IC_S:
+        r->fuel--;
+        UL_TRACE_APPLY(r, clos);
+        UL_STATS_ADD(r->ctx, reductions[UL_COMB_S], 1);
+        m = clos->env.n_captured;
+        memcpy(args, clos->env.captured, m * sizeof(ul_value_t));
+        for (i = m; i < 3; i++) {
+            args[i] = ul_pop(r);
+        }
+        if (!tail) {
+            ul_push(r, UL_IMM(PC_OFF(r)));
+            ul_push(r, UL_FRAME_RET);
+        }
+        ul_enter_S(r, args);
+        r->in_bc = 0;
+        return UL_APPLY;
+    }
+    return UL_APPLY;
+}
+
+UL_HANDLER int ul_op_hlt(ul_regs_t *r) {
+    fflush(r->ctx->out);
+    return UL_HALT;
+}
+
+UL_HANDLER int ul_op_push(ul_regs_t *r) {
+    ul_push(r, (ul_value_t) r->acc);
+    return UL_NEXT;
+}
+
+UL_HANDLER int ul_op_push1(ul_regs_t *r) {
+    ul_push(r, ul_operand(r));
+    return UL_NEXT;
+}
+
+UL_HANDLER int ul_op_push2(ul_regs_t *r) {
+    ul_push(r, ul_operand(r));
+    ul_push(r, ul_operand(r));
+    return UL_NEXT;
+}
+
+UL_HANDLER int ul_op_pop(ul_regs_t *r) {
+    r->acc = (ul_closure_t *) ul_pop(r);
+    return UL_NEXT;
+}
+
+UL_HANDLER int ul_op_ld(ul_regs_t *r) {
+    r->acc = (ul_closure_t *) ul_operand(r);
+    return UL_NEXT;
+}
+
+UL_HANDLER int ul_op_swap(ul_regs_t *r) {
+    ul_value_t v = r->sp[-1];
+    r->sp[-1] = (ul_value_t) r->acc;
+    r->acc = (ul_closure_t *) v;
+    return UL_NEXT;
+}
+
+UL_HANDLER int ul_op_rev(ul_regs_t *r) {
+    size_t n = ul_operand(r), i;
+    ul_value_t v[3];
+
+    if (r->sp - n >= r->base) {
+        v[0] = r->sp[-1];
+        r->sp[-1] = r->sp[-n];
+        r->sp[-n] = v[0];
+        return UL_NEXT;
+    }
+    for (i = 0; i < n; i++) {
+        v[i] = ul_pop(r);
+    }
+    for (i = 0; i < n; i++) {
+        ul_push(r, v[i]);
+    }
+    return UL_NEXT;
+}
+
+UL_HANDLER int ul_op_apply_S(ul_regs_t *r) {
+    r->acc = &ul_S;
+    r->nargs = ul_operand(r);
+    return UL_APPLY;
+}
+
+UL_HANDLER int ul_op_apply_K(ul_regs_t *r) {
+    r->acc = &ul_K;
+    r->nargs = ul_operand(r);
+    return UL_APPLY;
+}
+
+UL_HANDLER int ul_op_apply_I(ul_regs_t *r) {
+    r->acc = &ul_I;
+    r->nargs = ul_operand(r);
+    return UL_APPLY;
+}
+
+UL_HANDLER int ul_op_apply_unk(ul_regs_t *r) {
+    r->nargs = ul_operand(r);
+    return ul_apply_ic(r, ul_operand(r), 0);
+}
+
+UL_HANDLER int ul_op_apply1(ul_regs_t *r) {
+    ul_push(r, ul_operand(r));
+    r->nargs = 1;
+    return ul_apply_ic(r, ul_operand(r), 0);
+}
+
+UL_HANDLER int ul_op_swap_apply(ul_regs_t *r) {
+    ul_op_swap(r);
+    r->nargs = ul_operand(r);
+    return ul_apply_ic(r, ul_operand(r), 0);
+}
+
+UL_HANDLER int ul_op_tapply_unk(ul_regs_t *r) {
+    r->nargs = ul_operand(r);
+    return ul_apply_ic(r, ul_operand(r), 1);
+}
+
+UL_HANDLER int ul_op_tapply1(ul_regs_t *r) {
+    ul_push(r, ul_operand(r));
+    r->nargs = 1;
+    return ul_apply_ic(r, ul_operand(r), 1);
+}
+
+UL_HANDLER int ul_op_tswap_apply(ul_regs_t *r) {
+    ul_op_swap(r);
+    r->nargs = ul_operand(r);
+    return ul_apply_ic(r, ul_operand(r), 1);
+}
+
+UL_HANDLER int ul_op_promise(ul_regs_t *r) {
+    size_t off = ul_operand(r);
+    ul_closure_t *new = ul_regs_alloc(r, 1);
+    new->kind = UL_COMB_Promise;
+    new->arity = 2;
+    new->env.n_captured = 1;
+    new->env.captured[0] = (ul_closure_t *) UL_IMM(off);
+    r->acc = new;
+    return UL_NEXT;
+}
+
+UL_HANDLER int ul_op_call(ul_regs_t *r) {
+    size_t off = ul_operand(r);
+    ul_push(r, UL_IMM(PC_OFF(r)));
+    ul_push(r, UL_FRAME_RET);
+    r->pc = r->ctx->ul_bc.data + off;
+    return UL_NEXT;
+}
+
+UL_HANDLER int ul_op_dcall(ul_regs_t *r) {
+    ul_closure_t *f = (ul_closure_t *) r->sp[-1];
+    /* by kind, an image has a d of its own */
+    if (f->kind == UL_COMB_D && !f->env.n_captured) {
+        /* `dF delays F, which we get by applying i to the promise */
+        r->sp[-1] = (ul_value_t) &ul_I;
+        return ul_op_promise(r);
+    }
+    return ul_op_call(r);
+}
+
+UL_HANDLER int ul_op_pdcall(ul_regs_t *r) {
+    ul_push(r, (ul_value_t) r->acc);
+    return ul_op_dcall(r);
+}
+
+UL_HANDLER int ul_op_ret(ul_regs_t *r) {
+    r->in_bc = 0;
+    return UL_RET;
+}
+
+UL_HANDLER int ul_op_jmp(ul_regs_t *r) {
+    r->pc = r->ctx->ul_bc.data + ul_operand(r);
+    return UL_NEXT;
+}
+
+UL_HANDLER int ul_op_stub(ul_regs_t *r) {
+    ul_ctx_t *ctx = r->ctx;
+    size_t at = PC_OFF(r) - 1, ref;
+    ul_ast_t *ast = (ul_ast_t *) ul_operand(r);
+    ssize_t off;
+
+    if ((off = ul_compile(ctx, ast, ret)) < 0) {
+        ul_abort(ctx, UL_RUN_OOM);
+    }
+    /* the buffer may have moved */
+    r->pc = ctx->ul_bc.data + at;
+    memcpy(&ref, r->pc + 1 + sizeof(size_t), sizeof(ref));
+    memcpy(ctx->ul_bc.data + ref, &off, sizeof(off));
+    /* promises made before now still point here; the hlt padding keeps the
+     * code walkable for ul_compile_all */
+    *r->pc = jmp;
+    memcpy(r->pc + 1, &off, sizeof(off));
+    memset(r->pc + 1 + sizeof(size_t), hlt, sizeof(size_t));
+    return UL_NEXT;
+}
+
+/* Apply acc to the nargs values on top of the stack, and go on popping
+ * continuation frames until the bytecode can resume.
+ *
+ * Every application costs one unit of fuel, but only the applications here
+ * check for it running out: anything that goes on for long comes through
+ * here, while the inline caches just take their units. Out of fuel, the
+ * application is left undone for ul_run to resume. */
+static inline __attribute__((always_inline)) int ul_engine(ul_regs_t *r, int entry) {
+    size_t need, m, i;
+    ul_closure_t *clos;
+    ul_value_t args[3], v;
+
+/* Frames pushed from bytecode must be topped off by a RET frame first. */
+#define ENTER_MACHINE() \
+    do { \
+        if (r->in_bc) { \
+            ul_push(r, UL_IMM(PC_OFF(r))); \
+            ul_push(r, UL_FRAME_RET); \
+            r->in_bc = 0; \
+        } \
+    } while (0)
+#define RETURN() \
+    do { \
+        if (r->in_bc) return UL_NEXT; \
+        goto ret; \
+    } while (0)
+
+    if (entry == UL_RET) {
+        goto ret;
+    }
+apply:
+    if (--r->fuel < 0) {
+        return UL_SUSPEND;
+    }
+    clos = r->acc;
+    UL_PROF_KIND(clos->kind);
+    UL_TRACE_APPLY(r, clos);
+    m = clos->env.n_captured;
+    need = clos->arity - m;
+    if (r->nargs < need) {
+        UL_STATS_ADD(r->ctx, partial, 1);
+        ul_apply_partial(r);
+        RETURN();
+    }
+    UL_STATS_ADD(r->ctx, reductions[clos->kind], 1);
+    memcpy(args, clos->env.captured, m * sizeof(ul_value_t));
+    for (i = m; i < clos->arity; i++) {
+        args[i] = ul_pop(r);
+    }
+    if (r->nargs > need) {
+        r->nargs -= need;
+        if (r->in_bc) {
+            /* the RET frame goes below the leftover arguments */
+            ul_stack_insert_ret(r, r->nargs, PC_OFF(r));
+            r->in_bc = 0;
+        }
+        ul_push(r, UL_IMM(r->nargs));
+        ul_push(r, UL_FRAME_APPLY);
+    }
+    switch (clos->kind) {
+    case UL_COMB_S:
+        ENTER_MACHINE();
+        ul_enter_S(r, args);
+        goto apply;
+    case UL_COMB_K:
+    case UL_COMB_I:
+        r->acc = (ul_closure_t *) args[0];
+        RETURN();
+    case UL_COMB_V:
+        RETURN();
+    case UL_COMB_Dot:
+        putc(UL_IMM_VAL(args[0]), r->ctx->out);
+        r->acc = (ul_closure_t *) args[1];
+        RETURN();
+    case UL_COMB_D:
+        ul_push(r, args[1]);
+        r->acc = (ul_closure_t *) args[0];
+        r->nargs = 1;
+        goto apply;
+    case UL_COMB_Promise:
+        /* force the promise, then apply its value to the argument */
+        ENTER_MACHINE();
+        ul_push(r, args[1]);
+        ul_push(r, UL_IMM(1));
+        ul_push(r, UL_FRAME_APPLY);
+        r->pc = r->ctx->ul_bc.data + UL_IMM_VAL(args[0]);
+        if (*r->pc == jmp) {
+            /* the promise was made before its code was compiled */
+            memcpy(&m, r->pc + 1, sizeof(m));
+            clos->env.captured[0] = (ul_closure_t *) UL_IMM(m);
+            r->pc = r->ctx->ul_bc.data + m;
+        }
+        r->in_bc = 1;
+        return UL_NEXT;
+    case UL_COMB_C:
+        /* `cf applies f to the continuation of `cf */
+        ENTER_MACHINE();
+        r->acc = (ul_closure_t *) args[0];
+        v = (ul_value_t) ul_stack_capture(r);
+        ul_push(r, v);
+        r->nargs = 1;
+        goto apply;
+    case UL_COMB_Cont:
+        ul_stack_restore(r, (ul_closure_t *) args[0]);
+        r->acc = (ul_closure_t *) args[1];
+        r->in_bc = 0;
+        goto ret;
+    }
+    ul_panic("bad closure kind %u", clos->kind);
+
+ret:
+    switch (ul_pop(r)) {
+    case UL_FRAME_RET:
+        r->pc = r->ctx->ul_bc.data + UL_IMM_VAL(ul_pop(r));
+        r->in_bc = 1;
+        return UL_NEXT;
+    case UL_FRAME_APPLY:
+        r->nargs = UL_IMM_VAL(ul_pop(r));
+        goto apply;
+    case UL_FRAME_S1:
+        args[1] = ul_pop(r);
+        args[2] = ul_pop(r);
+        ul_push(r, (ul_value_t) r->acc);
+        ul_push(r, UL_FRAME_S2);
+        ul_push(r, args[2]);
+        r->acc = (ul_closure_t *) args[1];
+        r->nargs = 1;
+        goto apply;
+    case UL_FRAME_S2:
+        v = ul_pop(r);
+        ul_push(r, (ul_value_t) r->acc);
+        r->acc = (ul_closure_t *) v;
+        r->nargs = 1;
+        goto apply;
+    case UL_FRAME_S3:
+        args[0] = ul_pop(r);
+        args[2] = ul_pop(r);
+        ul_push(r, (ul_value_t) r->acc);
+        ul_push(r, args[2]);
+        r->acc = (ul_closure_t *) args[0];
+        r->nargs = 2;
+        goto apply;
+    }
+    ul_panic("corrupted stack");
+#undef RETURN
+#undef ENTER_MACHINE
+}
+
+#ifdef CALL_THREADING
+static __attribute__((noinline)) int ul_engine_call(ul_regs_t *r, int entry) {
+    return ul_engine(r, entry);
+}
+#endif
+
+static __attribute__((noinline)) int ul_dispatch(ul_ctx_t *ctx) {
+    ul_regs_t r = {
+        .pc = ctx->rt_pc ? ctx->rt_pc : ctx->ul_bc.data,
+        .sp = ctx->sp,
+        .base = ctx->seg->lo,
+        .limit = ctx->seg->limit,
+        .acc = ctx->rt_val,
+        .nargs = ctx->rt_nargs,
+        .in_bc = ctx->rt_pc ? ctx->rt_in_bc : 1,
+        .fuel = ctx->fuel,
+        .ctx = ctx,
+    };
+    uint8_t op = hlt;
+    int entry = ctx->rt_pc ? UL_APPLY : UL_NEXT;
+#ifdef CALL_THREADING
+    static int (*const optbl[])(ul_regs_t *) = {
+        #define T(op, n) &ul_op_##op,
+        UL_OPCODE_LIST(T)
+        #undef T
+    };
+    if (entry == UL_APPLY && ul_engine_call(&r, entry) != UL_NEXT) {
+        goto suspend;
+    }
+    for (;;) {
+        UL_OPSTATS_COUNT(op, *r.pc);
+        UL_PROF_PC(r.pc);
+        switch ((entry = optbl[(op = *r.pc++)](&r))) {
+        case UL_NEXT:
+            break;
+        case UL_HALT:
+            goto halt;
+        default:
+            if (ul_engine_call(&r, entry) != UL_NEXT) {
+                goto suspend;
+            }
+        }
+    }
+#else
+#ifdef DIRECT_THREADING
+    static void *jmptbl[] = {
+        #define T(op, n) &&jmptbl_##op,
+        UL_OPCODE_LIST(T)
+        #undef T
+    };
+    #define CASE(op) jmptbl_##op
+    #define DISPATCH() \
+        do { \
+            UL_OPSTATS_COUNT(op, *r.pc); \
+            UL_PROF_PC(r.pc); \
+            goto *jmptbl[(op = *r.pc++)]; \
+        } while (0)
+#else
+    #define CASE(op) case op
+    #define DISPATCH() \
+        do { \
+            UL_OPSTATS_COUNT(op, *r.pc); \
+            UL_PROF_PC(r.pc); \
+            goto dispatch; \
+        } while (0)
+#endif
+    /* the handlers return constants, so this folds into a jump */
+    #define ACTION(a) \
+        switch ((entry = (a))) { \
+        case UL_NEXT: \
+            DISPATCH(); \
+        case UL_HALT: \
+            goto halt; \
+        default: \
+            goto engine; \
+        }
+
+    if (entry == UL_APPLY) {
+        goto engine;
+    }
+    DISPATCH();
+#ifndef DIRECT_THREADING
+dispatch:
+    switch ((op = *r.pc++))
+#endif
+    {
+    #define T(op, n) CASE(op): ACTION(ul_op_##op(&r));
+    UL_OPCODE_LIST(T)
+    #undef T
+    }
+engine:
+    if (ul_engine(&r, entry) != UL_NEXT) {
+        goto suspend;
+    }
+    DISPATCH();
+    #undef ACTION
+    #undef DISPATCH
+    #undef CASE
+#endif
+halt:
+    ctx->sp = r.sp;
+    ctx->rt_val = r.acc;
+    ctx->rt_pc = NULL;
+    ctx->fuel = r.fuel < 0 ? 0 : r.fuel;
+    return UL_RUN_HALT;
+suspend:
+    ctx->sp = r.sp;
+    ctx->rt_val = r.acc;
+    ctx->rt_pc = r.pc;
+    ctx->rt_nargs = r.nargs;
+    ctx->rt_in_bc = r.in_bc;
+    ctx->fuel = 0;
+    return UL_RUN_FUEL;
+}
+#undef PC_OFF
+
+/* Run the program, or go on with a suspended run. The setjmp is kept out of
+ * ul_dispatch, nothing of which is needed once it has been given up on. */
+int ul_run(ul_ctx_t *ctx) {
+    int status;
+
+    if ((status = setjmp(ctx->abort))) {
+        return status;
+    }
+    /* gc_pause may have been set since */
+    gc_set_limit(ctx);
+    return ul_dispatch(ctx);
+}
+
+/* Images. ul -o image file compiles the whole program ahead of time and
+ * writes it out in a form that is mapped read-only and run in place, so
+ * every process running it shares the same pages:
+ *
+ *   header       UL_IMAGE_HDR_SIZE bytes, a ul_image_hdr_t
+ *   code         ul_bc with no stubs left, right after the header
+ *   constants    the closures the code refers to
+ *   heap         checkpoints only, the live closures after a GC
+ *   segments     checkpoints only, a ul_image_seg_t per stack segment, then
+ *                the values of each, followed by a spare word
+ *   relocations  the file offset of every pointer into the image
+ *   source map   reserved and left empty: the units mapping code to the
+ *                program text are kept only by the run that compiled it
+ *
+ * The pointers in the code and the constants are those of the image mapped
+ * at base. Where that address is taken the image is mapped privately and
+ * relocated instead, which loses the sharing. A loaded image backs ul_bc
+ * through a dynbuf realloc that never grows it and unmaps it when freed.
+ *
+ * A checkpoint is an image of a suspended run, which goes on from where it
+ * stopped when the image is loaded. Its heap and its stack are copied out
+ * of the file into a fresh context, then relocated whatever the address
+ * the file is mapped at: every pointer in them is written as if it pointed
+ * into the file mapped at base. A relocation with UL_IMAGE_RELOC_SEG set is
+ * of a pointer to the segment itself rather than to its values. */
+#define UL_IMAGE_MAGIC "ulimage"
+/* closures are larger in a build with -DUL_CENSUS, which has images of its
+ * own */
+#ifdef UL_CENSUS
+#define UL_IMAGE_VERSION 0x10003
+#else
+#define UL_IMAGE_VERSION 3
+#endif
+#define UL_IMAGE_HDR_SIZE 4096
+#ifndef UL_IMAGE_BASE
+#define UL_IMAGE_BASE 0x200000000000ULL
+#endif
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+#define UL_IMAGE_RELOC_SEG (1ULL << 63)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_ops;     /* of the opcode set the code is in */
+    uint64_t base;
+    uint64_t size;      /* of the whole file */
+    uint64_t n_ics;
+    uint64_t code_size;
+    uint64_t const_off;
+    uint64_t const_size;
+    uint64_t reloc_off;
+    uint64_t n_relocs;
+    uint64_t srcmap_off;
+    uint64_t srcmap_size;
+    /* the rest is 0 but in checkpoints */
+    uint64_t heap_off;
+    uint64_t heap_size;
+    uint64_t seg_off;
+    uint64_t n_segs;
+    /* the registers of the suspended run, the pointers relocated as above */
+    uint64_t rt_val;
+    uint64_t rt_pc;     /* offset in the code */
+    uint64_t rt_nargs;
+    uint64_t rt_in_bc;
+    uint64_t sp;
+    uint64_t seg;       /* index of ctx->seg */
+    uint64_t below;
+    uint64_t below_i;
+    uint64_t below_top;
+} ul_image_hdr_t;
+
+typedef struct {
+    uint64_t off;       /* of the values */
+    uint64_t size;      /* of the values written, from base */
+    uint64_t cap;       /* from base to limit */
+    uint64_t lo;        /* from base */
+    int64_t prev;       /* index, -1 for none */
+    uint64_t frozen;
+} ul_image_seg_t;
+
+typedef struct {
+    ul_closure_t *clos;
+    uint64_t off;       /* in the constant section */
+} ul_image_const_t;
+
+/* What an image is written from. */
+typedef struct {
+    ul_ctx_t *ctx;
+    ul_image_hdr_t hdr;
+    ul_image_const_t *consts;
+    size_t n_consts;
+    ul_seg_t **segs;
+    ul_image_seg_t *seg_tbl;
+    uint8_t *done;      /* a byte per word of the segments, once written */
+    uint8_t *buf;
+    dynbuf_t relocs;
+} ul_image_out_t;
+
+/* Which operands of op are constant closures, bit i for operand i. */
+static int ul_op_consts(uint8_t op) {
+    switch (op) {
+    case push1:
+    case ld:
+    case apply1:
+    case tapply1:
+        return 1;
+    case push2:
+        return 3;
+    }
+    return 0;
+}
+
+/* Compile everything left behind stubs. Each stub becomes a jmp padded with
+ * hlt, so the code can still be walked an instruction at a time. */
+static int ul_compile_all(ul_ctx_t *ctx) {
+    size_t pc = 0, ref;
+    ul_ast_t *ast;
+    ssize_t off;
+    uint8_t *p;
+
+    while (pc < dynbuf_size(&ctx->ul_bc)) {
+        p = ctx->ul_bc.data + pc;
+        if (*p == stub) {
+            memcpy(&ast, p + 1, sizeof(ast));
+            memcpy(&ref, p + 1 + sizeof(size_t), sizeof(ref));
+            if ((off = ul_compile(ctx, ast, ret)) < 0) {
+                return -1;
+            }
+            p = ctx->ul_bc.data + pc;
+            memcpy(ctx->ul_bc.data + ref, &off, sizeof(off));
+            *p = jmp;
+            memcpy(p + 1, &off, sizeof(off));
+            memset(p + 1 + sizeof(size_t), hlt, sizeof(size_t));
+            pc += 1 + 2 * sizeof(size_t);
+        } else {
+            pc += 1 + ul_op_noperands[*p] * sizeof(size_t);
+        }
+    }
+    return 0;
+}
+
+static int ul_image_const_cmp(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t) ((const ul_image_const_t *) a)->clos;
+    uintptr_t y = (uintptr_t) ((const ul_image_const_t *) b)->clos;
+    return x < y ? -1 : x > y;
+}
+
+static int ul_image_realloc(dynbuf_t *buf, size_t new_size);
+
+/* The constant closures of ctx: the atoms, the dots and those made by the
+ * compiler, or those of the image ctx was loaded from. */
+static int ul_image_consts(ul_image_out_t *img) {
+    ul_ctx_t *ctx = img->ctx;
+    size_t n = 0, max = 6;
+    uint8_t *p = NULL, *end = NULL;
+
+    if (ctx->ul_bc.realloc == &ul_image_realloc) {
+        ul_image_hdr_t *hdr = (ul_image_hdr_t *) (ctx->ul_bc.data - UL_IMAGE_HDR_SIZE);
+        p = (uint8_t *) hdr + hdr->const_off;
+        end = p + hdr->const_size;
+        for (uint8_t *q = p; q < end; q += ul_closure_size(((ul_closure_t *) q)->env.n_captured)) {
+            max++;
+        }
+    } else {
+        max += 256 + dynbuf_size(&ctx->ul_consts) / sizeof(void *);
+    }
+    if (!(img->consts = malloc(max * sizeof(ul_image_const_t)))) {
+        return -1;
+    }
+#define T(x) img->consts[n++].clos = &ul_##x;
+    UL_ATOM_LIST(T)
+#undef T
+    for (; p < end; p += ul_closure_size(((ul_closure_t *) p)->env.n_captured)) {
+        img->consts[n++].clos = (ul_closure_t *) p;
+    }
+    if (!end) {
+        for (int i = 0; i < 256; i++) {
+            if (ctx->dots[i]) {
+                img->consts[n++].clos = ctx->dots[i];
+            }
+        }
+        for (size_t i = 0; i < dynbuf_size(&ctx->ul_consts); i += sizeof(void *)) {
+            memcpy(&img->consts[n++].clos, ctx->ul_consts.data + i, sizeof(void *));
+        }
+    }
+    img->n_consts = n;
+    return 0;
+}
+
+/* Where the closure p is in the image, 0 for NULL. */
+static int ul_image_val(ul_image_out_t *img, void *p, uint64_t *v) {
+    ul_ctx_t *ctx = img->ctx;
+    ul_image_const_t key = { .clos = p }, *c;
+
+    if (!p) {
+        *v = 0;
+    } else if ((uint8_t *) p >= ctx->gc_from && (uint8_t *) p < ctx->gc_allocp) {
+        *v = img->hdr.base + img->hdr.heap_off + ((uint8_t *) p - ctx->gc_from);
+    } else if ((c = bsearch(&key, img->consts, img->n_consts, sizeof(*c), ul_image_const_cmp))) {
+        *v = img->hdr.base + img->hdr.const_off + c->off;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/* Where the stack slot p is in the image, 0 for NULL. The top of a full
+ * segment is the spare word after it. */
+static int ul_image_stk(ul_image_out_t *img, ul_value_t *p, uint64_t *v) {
+    if (!p) {
+        *v = 0;
+        return 0;
+    }
+    for (size_t i = 0; i < img->hdr.n_segs; i++) {
+        ul_value_t *base = img->segs[i]->base;
+        if (p >= base && (uint8_t *) p <= (uint8_t *) base + img->seg_tbl[i].size) {
+            *v = img->hdr.base + img->seg_tbl[i].off + ((uint8_t *) p - (uint8_t *) base);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static ssize_t ul_image_seg_index(ul_image_out_t *img, ul_seg_t *seg) {
+    for (size_t i = 0; i < img->hdr.n_segs; i++) {
+        if (img->segs[i] == seg) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Point the value at file offset at, which is in buf, into the image. how
+ * is 0 for a value, 's' for a stack slot and 'g' for a segment. */
+static int ul_image_reloc(ul_image_out_t *img, uint64_t at, int how) {
+    void *p;
+    uint64_t v;
+    ssize_t i;
+
+    memcpy(&p, img->buf + at, sizeof(p));
+    if (how == 'g') {
+        if ((i = ul_image_seg_index(img, p)) < 0) {
+            return -1;
+        }
+        v = img->hdr.base + img->seg_tbl[i].off;
+    } else if (how == 's') {
+        if (ul_image_stk(img, p, &v) < 0) {
+            return -1;
+        }
+    } else if (!UL_IS_CLOS(p)) {
+        return 0;
+    } else if (ul_image_val(img, p, &v) < 0) {
+        return -1;
+    }
+    if (!p) {
+        return 0;
+    }
+    memcpy(img->buf + at, &v, sizeof(v));
+    at |= how == 'g' ? UL_IMAGE_RELOC_SEG : 0;
+    return dynbuf_put(&img->relocs, (uint8_t *) &at, sizeof(at));
+}
+
+/* Note that the values from lo to top of seg are live, or write them out
+ * relocated once the segments are laid out. */
+static int ul_image_range(ul_image_out_t *img, ul_seg_t *seg, ul_value_t *lo, ul_value_t *top, int write) {
+    ssize_t i = ul_image_seg_index(img, seg);
+    ul_image_seg_t *s;
+
+    if (i < 0) {
+        return -1;
+    }
+    s = &img->seg_tbl[i];
+    if (!write) {
+        /* frozen marks the segment in use until the layout fills it in */
+        s->frozen = 1;
+        if ((uint64_t) ((uint8_t *) top - (uint8_t *) seg->base) > s->size) {
+            s->size = (uint8_t *) top - (uint8_t *) seg->base;
+        }
+        return 0;
+    }
+    for (ul_value_t *p = lo; p < top; p++) {
+        uint64_t at = s->off + ((uint8_t *) p - (uint8_t *) seg->base);
+        if (img->done[at / sizeof(ul_value_t)]) {
+            continue;
+        }
+        img->done[at / sizeof(ul_value_t)] = 1;
+        memcpy(img->buf + at, p, sizeof(*p));
+        if (ul_image_reloc(img, at, 0) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Every range of stack values the run can still get at: those of the
+ * running stack and those of the frozen stacks in the heap. */
+static int ul_image_ranges(ul_image_out_t *img, int write) {
+    ul_ctx_t *ctx = img->ctx;
+
+    for (ul_seg_t *seg = ctx->seg; seg; seg = seg->prev) {
+        if (ul_image_range(img, seg, seg->lo, seg == ctx->seg ? ctx->sp : seg->limit, write) < 0) {
+            return -1;
+        }
+    }
+    for (uint8_t *p = ctx->gc_from; p < ctx->gc_allocp; ) {
+        ul_closure_t *clos = (ul_closure_t *) p;
+        if (clos->kind == UL_COMB_Stack) {
+            for (size_t i = 0; i < UL_STACK_NSEGS(clos); i++) {
+                if (ul_image_range(img, UL_STACK_SEG(clos, i), UL_STACK_LO(clos, i),
+                                   UL_STACK_TOP(clos, i), write) < 0) {
+                    return -1;
+                }
+            }
+        }
+        p += ul_closure_size(clos->env.n_captured);
+    }
+    return 0;
+}
+
+/* Lay out the heap and the stack of the suspended run of ctx, which has
+ * just been collected, after the constants. Returns the end of the layout. */
+static int ul_image_layout_run(ul_image_out_t *img, uint64_t *end) {
+    ul_ctx_t *ctx = img->ctx;
+    ul_image_hdr_t *hdr = &img->hdr;
+    size_t n = 0, k = 0;
+    uint64_t off;
+
+    for (ul_seg_t *seg = ctx->segs; seg; seg = seg->all) {
+        n++;
+    }
+    if (!(img->segs = malloc(n * sizeof(*img->segs))) ||
+        !(img->seg_tbl = calloc(n, sizeof(*img->seg_tbl)))) {
+        return -1;
+    }
+    for (ul_seg_t *seg = ctx->segs; seg; seg = seg->all) {
+        img->segs[k++] = seg;
+    }
+    hdr->n_segs = n;
+    if (ul_image_ranges(img, 0) < 0) {
+        return -1;
+    }
+    /* keep only the segments in use */
+    for (size_t i = k = 0; i < n; i++) {
+        if (img->seg_tbl[i].frozen) {
+            img->segs[k] = img->segs[i];
+            img->seg_tbl[k++].size = img->seg_tbl[i].size;
+        }
+    }
+    hdr->n_segs = k;
+    hdr->heap_off = *end;
+    hdr->heap_size = ctx->gc_allocp - ctx->gc_from;
+    hdr->seg_off = hdr->heap_off + hdr->heap_size;
+    off = hdr->seg_off + k * sizeof(ul_image_seg_t);
+    for (size_t i = 0; i < k; i++) {
+        ul_seg_t *seg = img->segs[i];
+        ul_image_seg_t *s = &img->seg_tbl[i];
+        s->off = off;
+        s->cap = (uint8_t *) seg->limit - (uint8_t *) seg->base;
+        s->lo = (uint8_t *) seg->lo - (uint8_t *) seg->base;
+        s->frozen = seg->frozen;
+        s->prev = seg->prev ? ul_image_seg_index(img, seg->prev) : -1;
+        off += s->size + sizeof(ul_value_t);
+    }
+    *end = off;
+    return 0;
+}
+
+/* Write the heap, the stack and the registers of the run out into buf. */
+static int ul_image_write_run(ul_image_out_t *img) {
+    ul_ctx_t *ctx = img->ctx;
+    ul_image_hdr_t *hdr = &img->hdr;
+
+    if (!(img->done = calloc(hdr->reloc_off / sizeof(ul_value_t), 1))) {
+        return -1;
+    }
+    memcpy(img->buf + hdr->heap_off, ctx->gc_from, hdr->heap_size);
+    for (uint64_t at = hdr->heap_off; at < hdr->heap_off + hdr->heap_size; ) {
+        ul_closure_t *clos = (ul_closure_t *) (ctx->gc_from + (at - hdr->heap_off));
+        for (size_t i = 0; i < clos->env.n_captured; i++) {
+            int how = 0;
+            if (clos->kind == UL_COMB_Stack && i >= 2) {
+                /* a top, then a segment, lo and top per segment */
+                how = i == 2 || i % 3 ? 's' : 'g';
+            }
+            if (ul_image_reloc(img, at + ul_closure_size(i), how) < 0) {
+                return -1;
+            }
+        }
+        at += ul_closure_size(clos->env.n_captured);
+    }
+    memcpy(img->buf + hdr->seg_off, img->seg_tbl, hdr->n_segs * sizeof(ul_image_seg_t));
+    if (ul_image_ranges(img, 1) < 0 ||
+        ul_image_val(img, ctx->rt_val, &hdr->rt_val) < 0 ||
+        ul_image_val(img, ctx->below, &hdr->below) < 0 ||
+        ul_image_stk(img, ctx->sp, &hdr->sp) < 0 ||
+        ul_image_stk(img, ctx->below_top, &hdr->below_top) < 0) {
+        return -1;
+    }
+    hdr->rt_pc = ctx->rt_pc - ctx->ul_bc.data;
+    hdr->rt_nargs = ctx->rt_nargs;
+    hdr->rt_in_bc = ctx->rt_in_bc;
+    hdr->seg = ul_image_seg_index(img, ctx->seg);
+    hdr->below_i = ctx->below_i;
+    return 0;
+}
+
+/* Write out the code of ctx, and the suspended run of ctx too if run is
+ * set, which must have been collected just before. */
+static int ul_image_write(ul_ctx_t *ctx, FILE *out, int run) {
+    ul_image_out_t img = {
+        .ctx = ctx,
+        .hdr = { .magic = UL_IMAGE_MAGIC, .version = UL_IMAGE_VERSION },
+    };
+    ul_image_hdr_t *hdr = &img.hdr;
+    uint64_t end;
+    int rc = -1;
+
+    dynbuf_init(&img.relocs);
+    if (ul_compile_all(ctx) < 0 || ul_image_consts(&img) < 0) {
+        goto out;
+    }
+    hdr->n_ops = UL_N_OPS;
+    hdr->base = UL_IMAGE_BASE;
+    hdr->n_ics = dynbuf_size(&ctx->ul_ics) / sizeof(ul_ic_t);
+    hdr->code_size = dynbuf_size(&ctx->ul_bc);
+    hdr->const_off = (UL_IMAGE_HDR_SIZE + hdr->code_size + 7) & ~7ULL;
+    for (size_t i = 0; i < img.n_consts; i++) {
+        img.consts[i].off = hdr->const_size;
+        hdr->const_size += ul_closure_size(img.consts[i].clos->env.n_captured);
+    }
+    end = hdr->const_off + hdr->const_size;
+    if (run && ul_image_layout_run(&img, &end) < 0) {
+        goto out;
+    }
+    hdr->reloc_off = end;
+    qsort(img.consts, img.n_consts, sizeof(*img.consts), ul_image_const_cmp);
+    if (!(img.buf = calloc(1, hdr->reloc_off))) {
+        goto out;
+    }
+    memcpy(img.buf + UL_IMAGE_HDR_SIZE, ctx->ul_bc.data, hdr->code_size);
+    for (size_t pc = 0; pc < hdr->code_size; ) {
+        uint8_t op = ctx->ul_bc.data[pc];
+        for (int i = 0; i < ul_op_noperands[op]; i++) {
+            if ((ul_op_consts(op) & (1 << i)) &&
+                ul_image_reloc(&img, UL_IMAGE_HDR_SIZE + pc + 1 + i * sizeof(size_t), 0) < 0) {
+                goto out;
+            }
+        }
+        pc += 1 + ul_op_noperands[op] * sizeof(size_t);
+    }
+    for (size_t i = 0; i < img.n_consts; i++) {
+        ul_closure_t *clos = img.consts[i].clos;
+        uint64_t at = hdr->const_off + img.consts[i].off;
+        memcpy(img.buf + at, clos, ul_closure_size(clos->env.n_captured));
+        for (size_t j = 0; j < clos->env.n_captured; j++) {
+            if (ul_image_reloc(&img, at + ul_closure_size(j), 0) < 0) {
+                goto out;
+            }
+        }
+    }
+    if (run && ul_image_write_run(&img) < 0) {
+        goto out;
+    }
+    hdr->n_relocs = dynbuf_size(&img.relocs) / sizeof(uint64_t);
+    hdr->srcmap_off = hdr->reloc_off + dynbuf_size(&img.relocs);
+    hdr->size = hdr->srcmap_off;
+    memcpy(img.buf, hdr, sizeof(*hdr));
+    if (fwrite(img.buf, 1, hdr->reloc_off, out) == hdr->reloc_off &&
+        fwrite(img.relocs.data, 1, dynbuf_size(&img.relocs), out) == dynbuf_size(&img.relocs) &&
+        fflush(out) == 0) {
+        rc = 0;
+    }
+out:
+    free(img.buf);
+    free(img.consts);
+    free(img.segs);
+    free(img.seg_tbl);
+    free(img.done);
+    dynbuf_free(&img.relocs);
+    return rc;
+}
+
+/* Checkpoint the run suspended in ctx to out, which ul_ctx_load_image
+ * resumes it from. The run can go on here as well. */
+int ul_checkpoint(ul_ctx_t *ctx, FILE *out) {
+    size_t pc;
+
+    if (!ctx->rt_pc || setjmp(ctx->abort)) {
+        return -1;
+    }
+    gc(ctx);
+    pc = ctx->rt_pc - ctx->ul_bc.data;
+    if (ul_compile_all(ctx) < 0) {
+        return -1;
+    }
+    ctx->rt_pc = ctx->ul_bc.data + pc;
+    return ul_image_write(ctx, out, 1);
+}
+
+static int ul_image_realloc(dynbuf_t *buf, size_t new_size) {
+    if (new_size) {
+        return -1;
+    }
+    munmap(buf->data - UL_IMAGE_HDR_SIZE, UL_IMAGE_HDR_SIZE + buf->cap);
+    buf->data = NULL;
+    buf->cap = 0;
+    return 0;
+}
+
+/* Where the pointer v of an image mapped at map points once it is loaded
+ * into ctx: into the mapping, the heap or one of segs. how is 0 for a value
+ * or a stack slot, 'g' for a segment and 'w' for a word to write to, which
+ * cannot be the spare one after a segment. */
+static int ul_image_ptr(ul_ctx_t *ctx, uint8_t *map, ul_seg_t **segs, uint64_t v, int how, void **p) {
+    ul_image_hdr_t *hdr = (ul_image_hdr_t *) map;
+    ul_image_seg_t *tbl = (ul_image_seg_t *) (map + hdr->seg_off);
+    uint64_t off = v - hdr->base;
+
+    if (!v) {
+        *p = NULL;
+        return 0;
+    }
+    for (uint64_t i = 0; i < hdr->n_segs; i++) {
+        if (off >= tbl[i].off && off <= tbl[i].off + tbl[i].size) {
+            if ((how == 'g' && off != tbl[i].off) || (how == 'w' && off == tbl[i].off + tbl[i].size)) {
+                return -1;
+            }
+            *p = how == 'g' ? (void *) segs[i] : (void *) ((uint8_t *) segs[i]->base + (off - tbl[i].off));
+            return 0;
+        }
+    }
+    if (how == 'g' || off < (how == 'w' ? hdr->heap_off : UL_IMAGE_HDR_SIZE) ||
+        off >= hdr->seg_off) {
+        return -1;
+    }
+    *p = off >= hdr->heap_off ? ctx->gc_from + (off - hdr->heap_off) : map + off;
+    return 0;
+}
+
+/* Copy the heap and the stack of the run checkpointed in the image mapped
+ * at map into ctx, which is fresh, and relocate them. */
+static int ul_image_load_run(ul_ctx_t *ctx, uint8_t *map) {
+    ul_image_hdr_t *hdr = (ul_image_hdr_t *) map;
+    ul_image_seg_t *tbl = (ul_image_seg_t *) (map + hdr->seg_off);
+    ul_seg_t **segs;
+    uint64_t at, v;
+    void *p, *q;
+    int how, rc = -1;
+
+    if (hdr->heap_off < hdr->const_off + hdr->const_size || hdr->heap_size > ctx->heap_max ||
+        hdr->seg_off != hdr->heap_off + hdr->heap_size || !hdr->n_segs ||
+        hdr->n_segs > (hdr->reloc_off - hdr->seg_off) / sizeof(*tbl) ||
+        hdr->seg >= hdr->n_segs || hdr->rt_pc > hdr->code_size ||
+        (hdr->heap_off | hdr->heap_size) % sizeof(ul_value_t)) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < hdr->n_segs; i++) {
+        if (tbl[i].off < hdr->seg_off + hdr->n_segs * sizeof(*tbl) || tbl[i].size > tbl[i].cap ||
+            tbl[i].off + tbl[i].size + sizeof(ul_value_t) > hdr->reloc_off || tbl[i].lo > tbl[i].cap ||
+            tbl[i].prev >= (int64_t) hdr->n_segs || (tbl[i].off | tbl[i].size | tbl[i].lo) % sizeof(ul_value_t)) {
+            return -1;
+        }
+    }
+    if (!(segs = calloc(hdr->n_segs, sizeof(*segs)))) {
+        return -1;
+    }
+    /* the first segment of the fresh context is of no use */
+    for (ul_seg_t *seg = ctx->segs, *all; seg; seg = all) {
+        all = seg->all;
+        munmap(seg, seg->map_size);
+    }
+    ctx->segs = NULL;
+    ctx->stack_mapped = 0;
+    for (uint64_t i = 0; i < hdr->n_segs; i++) {
+        if (!(segs[i] = ul_seg_new(ctx, tbl[i].cap)) ||
+            (uint8_t *) segs[i]->limit - (uint8_t *) segs[i]->base != (ptrdiff_t) tbl[i].cap) {
+            goto out;
+        }
+        memcpy(segs[i]->base, map + tbl[i].off, tbl[i].size);
+        segs[i]->lo = (ul_value_t *) ((uint8_t *) segs[i]->base + tbl[i].lo);
+        segs[i]->frozen = tbl[i].frozen;
+    }
+    for (uint64_t i = 0; i < hdr->n_segs; i++) {
+        segs[i]->prev = tbl[i].prev < 0 ? NULL : segs[tbl[i].prev];
+    }
+    gc_resize(ctx, hdr->heap_size);
+    memcpy(ctx->gc_from, map + hdr->heap_off, hdr->heap_size);
+    ctx->gc_allocp = ctx->gc_from + hdr->heap_size;
+    for (uint64_t i = 0; i < hdr->n_relocs; i++) {
+        memcpy(&at, map + hdr->reloc_off + i * sizeof(at), sizeof(at));
+        how = at & UL_IMAGE_RELOC_SEG ? 'g' : 0;
+        if ((at &= ~UL_IMAGE_RELOC_SEG) < hdr->heap_off) {
+            continue;
+        }
+        if (at % sizeof(v) || at > hdr->reloc_off - sizeof(v)) {
+            goto out;
+        }
+        memcpy(&v, map + at, sizeof(v));
+        if (ul_image_ptr(ctx, map, segs, hdr->base + at, 'w', &p) < 0 ||
+            ul_image_ptr(ctx, map, segs, v, how, &q) < 0) {
+            goto out;
+        }
+        memcpy(p, &q, sizeof(q));
+    }
+    if (ul_image_ptr(ctx, map, segs, hdr->rt_val, 0, &p) < 0 ||
+        ul_image_ptr(ctx, map, segs, hdr->below, 0, &q) < 0) {
+        goto out;
+    }
+    ctx->rt_val = p;
+    ctx->below = q;
+    if (ul_image_ptr(ctx, map, segs, hdr->sp, 0, &p) < 0 ||
+        ul_image_ptr(ctx, map, segs, hdr->below_top, 0, &q) < 0) {
+        goto out;
+    }
+    ctx->sp = p;
+    ctx->below_top = q;
+    ctx->below_i = hdr->below_i;
+    ctx->seg = segs[hdr->seg];
+    ctx->rt_pc = ctx->ul_bc.data + hdr->rt_pc;
+    ctx->rt_nargs = hdr->rt_nargs;
+    ctx->rt_in_bc = hdr->rt_in_bc;
+    ctx->stack_gc_at = 2 * ctx->stack_mapped + UL_STACK_SEG_MAX;
+    rc = 0;
+out:
+    free(segs);
+    return rc;
+}
+
+/* Returns 1 if fd is not an image, -1 if it is a bad one. */
+static int ul_ctx_load_image(ul_ctx_t *ctx, int fd) {
+    ul_image_hdr_t hdr;
+    struct stat st;
+    uint8_t *map;
+    uint64_t at, v, run_off;
+
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || memcmp(hdr.magic, UL_IMAGE_MAGIC, sizeof(hdr.magic))) {
+        return 1;
+    }
+    if (hdr.version != UL_IMAGE_VERSION || hdr.n_ops != UL_N_OPS || fstat(fd, &st) < 0 ||
+        (uint64_t) st.st_size != hdr.size || hdr.code_size > hdr.const_off ||
+        hdr.const_off < UL_IMAGE_HDR_SIZE || hdr.reloc_off > hdr.size ||
+        hdr.n_relocs > (hdr.size - hdr.reloc_off) / sizeof(uint64_t) ||
+        hdr.heap_off > hdr.reloc_off || hdr.seg_off > hdr.reloc_off) {
+        return -1;
+    }
+    /* the run is relocated as it is copied out */
+    run_off = hdr.n_segs ? hdr.heap_off : hdr.reloc_off;
+    map = mmap((void *) (uintptr_t) hdr.base, hdr.size, PROT_READ, MAP_PRIVATE | MAP_FIXED_NOREPLACE, fd, 0);
+    if (map != (uint8_t *) (uintptr_t) hdr.base) {
+        if (map != MAP_FAILED) {
+            munmap(map, hdr.size);
+        }
+        if ((map = mmap(0, hdr.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+            return -1;
+        }
+        for (uint64_t i = 0; i < hdr.n_relocs; i++) {
+            memcpy(&at, map + hdr.reloc_off + i * sizeof(at), sizeof(at));
+            if ((at & ~UL_IMAGE_RELOC_SEG) >= run_off) {
+                continue;
+            }
+            if (at < UL_IMAGE_HDR_SIZE || at > hdr.reloc_off - sizeof(v)) {
+                munmap(map, hdr.size);
+                return -1;
+            }
+            memcpy(&v, map + at, sizeof(v));
+            v += (uintptr_t) map - hdr.base;
+            memcpy(map + at, &v, sizeof(v));
+        }
+        mprotect(map, hdr.size, PROT_READ);
+    }
+    dynbuf_free(&ctx->ul_bc);
+    dynbuf_init1(&ctx->ul_bc, &ul_image_realloc);
+    ctx->ul_bc.data = map + UL_IMAGE_HDR_SIZE;
+    ctx->ul_bc.size = hdr.code_size;
+    ctx->ul_bc.cap = hdr.size - UL_IMAGE_HDR_SIZE;
+    for (uint64_t i = 0; i < hdr.n_ics; i++) {
+        if (ul_ic_new(ctx) == (size_t) -1) {
+            return -1;
+        }
+    }
+    if (hdr.n_segs && ul_image_load_run(ctx, map) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static char *ul_read_file(FILE *in) {
+    dynbuf_t buf;
+    char chunk[4096];
+    size_t n;
+
+    dynbuf_init(&buf);
+    while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+        if (dynbuf_put(&buf, (uint8_t *) chunk, n) < 0) {
+            goto error;
+        }
+    }
+    if (ferror(in) || dynbuf_put_uint8_t(&buf, 0) < 0) {
+        goto error;
+    }
+    return (char *) buf.data;
+error:
+    dynbuf_free(&buf);
+    return NULL;
+}
+
+/* Server mode. ul -s path answers the requests of ul_serve.h on a Unix
+ * socket, one connection at a time on each of a fixed set of threads.
+ * Programs are cached by the hash of their text, each with a pool of
+ * contexts that have compiled as much of it as earlier runs needed; a context
+ * goes back to the pool reset after every run. A run goes on UL_SERVE_SLICE
+ * applications at a time, with its output flushed in between, and is given
+ * up on once its client has gone. */
+#ifndef UL_SERVE_SLICE
+#define UL_SERVE_SLICE (1L << 20)
+#endif
+#define UL_SERVE_POOL 8
+#define UL_SERVE_BUCKETS 256
+
+typedef struct ul_prog {
+    uint64_t id;
+    char *text;
+    ul_ast_t *ast;
+    size_t n_pool;
+    ul_ctx_t *pool[UL_SERVE_POOL];
+    struct ul_prog *next;
+} ul_prog_t;
+
+static pthread_mutex_t ul_progs_lock = PTHREAD_MUTEX_INITIALIZER;
+static ul_prog_t *ul_progs[UL_SERVE_BUCKETS];
+static long ul_serve_fuel;
+static long ul_serve_pause;
+
+static const uint32_t ul_serve_status[] = {
+    [UL_RUN_HALT] = UL_SERVE_OK,
+    [UL_RUN_FUEL] = UL_SERVE_FUEL,
+    [UL_RUN_OOM] = UL_SERVE_OOM,
+    [UL_RUN_STACK] = UL_SERVE_STACK,
+};
+
+/* FNV-1a */
+static uint64_t ul_hash(const char *text, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t) text[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Call with ul_progs_lock held. */
+static ul_prog_t *ul_prog_find(uint64_t id) {
+    ul_prog_t *prog = ul_progs[id % UL_SERVE_BUCKETS];
+    while (prog && prog->id != id) {
+        prog = prog->next;
+    }
+    return prog;
+}
+
+static int ul_read_full(int fd, void *buf, size_t len) {
+    ssize_t n;
+    while (len) {
+        if ((n = read(fd, buf, len)) <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf = (uint8_t *) buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int ul_write_full(int fd, const void *buf, size_t len) {
+    ssize_t n;
+    while (len) {
+        if ((n = send(fd, buf, len, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf = (const uint8_t *) buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int ul_serve_reply(int fd, uint32_t type, const void *data, uint32_t len) {
+    ul_serve_rep_t rep = { .type = type, .len = len };
+    if (ul_write_full(fd, &rep, sizeof(rep)) < 0 || ul_write_full(fd, data, len) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int ul_serve_end(int fd, uint32_t status) {
+    return ul_serve_reply(fd, UL_SERVE_END, &status, sizeof(status));
+}
+
+/* The write function of the stream a run prints to. */
+static ssize_t ul_serve_out(void *cookie, const char *buf, size_t len) {
+    if (ul_serve_reply(*(int *) cookie, UL_SERVE_OUT, buf, len) < 0) {
+        return -1;
+    }
+    return len;
+}
+
+/* A program whose hash is taken by another one gets the next free id. */
+static int ul_serve_load(int fd, uint32_t len) {
+    ul_parse_state_t state;
+    ul_prog_t *prog, *new;
+    uint64_t id;
+    char *text;
+
+    if (len > UL_SERVE_MAX_PROG) {
+        /* the program is left unread, so there is no going on after it */
+        ul_serve_end(fd, UL_SERVE_EPROTO);
+        return -1;
+    }
+    if (!(text = malloc(len + 1))) {
+        return -1;
+    }
+    if (ul_read_full(fd, text, len) < 0) {
+        goto error;
+    }
+    text[len] = '\0';
+    id = ul_hash(text, len);
+    pthread_mutex_lock(&ul_progs_lock);
+    while ((prog = ul_prog_find(id)) && strcmp(prog->text, text)) {
+        id++;
+    }
+    pthread_mutex_unlock(&ul_progs_lock);
+    if (prog) {
+        free(text);
+        return ul_serve_reply(fd, UL_SERVE_ID, &id, sizeof(id));
+    }
+    if (!(new = malloc(sizeof(ul_prog_t)))) {
+        goto error;
+    }
+    state.text = text;
+    state.error = UL_PARSE_OK;
+    state.base = NULL;
+    if (!(new->ast = ul_parse_prog(&state))) {
+        free(new);
+        free(text);
+        return ul_serve_end(fd, UL_SERVE_EPARSE);
+    }
+    new->text = text;
+    new->n_pool = 0;
+    /* it may have been loaded in the meantime */
+    pthread_mutex_lock(&ul_progs_lock);
+    while ((prog = ul_prog_find(id)) && strcmp(prog->text, text)) {
+        id++;
+    }
+    if (!prog) {
+        new->id = id;
+        new->next = ul_progs[id % UL_SERVE_BUCKETS];
+        ul_progs[id % UL_SERVE_BUCKETS] = new;
+    }
+    pthread_mutex_unlock(&ul_progs_lock);
+    if (prog) {
+        ul_ast_free(new->ast);
+        free(new);
+        free(text);
+    }
+    return ul_serve_reply(fd, UL_SERVE_ID, &id, sizeof(id));
+error:
+    free(text);
+    return -1;
+}
+
+static int ul_serve_run(int fd, uint64_t id, long fuel) {
+    cookie_io_functions_t io = { .write = ul_serve_out };
+    ul_prog_t *prog;
+    ul_ctx_t *ctx = NULL;
+    FILE *out;
+    int status, broken;
+
+    pthread_mutex_lock(&ul_progs_lock);
+    if ((prog = ul_prog_find(id)) && prog->n_pool) {
+        ctx = prog->pool[--prog->n_pool];
+    }
+    pthread_mutex_unlock(&ul_progs_lock);
+    if (!prog) {
+        return ul_serve_end(fd, UL_SERVE_ENOPROG);
+    }
+    if (!ctx) {
+        if (!(ctx = malloc(sizeof(ul_ctx_t)))) {
+            return ul_serve_end(fd, UL_SERVE_OOM);
+        }
+        if (ul_ctx_init(ctx, UL_HEAP_SIZE, UL_STACK_SIZE) < 0) {
+            free(ctx);
+            return ul_serve_end(fd, UL_SERVE_OOM);
+        }
+        ctx->gc_pause = ul_serve_pause;
+        /* the ast is the program's, ctx->ast is left alone */
+        if (ul_compile(ctx, prog->ast, hlt) < 0) {
+            status = UL_RUN_OOM;
+            goto destroy;
+        }
+    }
+    if (!(out = fopencookie(&fd, "w", io))) {
+        status = UL_RUN_OOM;
+        goto destroy;
+    }
+    ctx->out = out;
+    if (fuel <= 0 || fuel > ul_serve_fuel) {
+        fuel = ul_serve_fuel;
+    }
+    do {
+        ctx->fuel = fuel < UL_SERVE_SLICE ? fuel : UL_SERVE_SLICE;
+        fuel -= ctx->fuel;
+        status = ul_run(ctx);
+    } while (status == UL_RUN_FUEL && fuel > 0 && !fflush(out));
+    broken = fclose(out) == EOF;
+    ctx->out = stdout;
+    if (status != UL_RUN_HALT && status != UL_RUN_FUEL) {
+        goto destroy;
+    }
+    ul_ctx_reset(ctx);
+    pthread_mutex_lock(&ul_progs_lock);
+    if (prog->n_pool < UL_SERVE_POOL) {
+        prog->pool[prog->n_pool++] = ctx;
+        ctx = NULL;
+    }
+    pthread_mutex_unlock(&ul_progs_lock);
+    if (ctx) {
+        ul_ctx_destroy(ctx);
+        free(ctx);
+    }
+    return broken ? -1 : ul_serve_end(fd, ul_serve_status[status]);
+destroy:
+    ul_ctx_destroy(ctx);
+    free(ctx);
+    return ul_serve_end(fd, ul_serve_status[status]);
+}
+
+static void ul_serve_conn(int fd) {
+    ul_serve_req_t req;
+    int rc;
+
+    while (ul_read_full(fd, &req, sizeof(req)) == 0) {
+        if (req.op == UL_SERVE_LOAD) {
+            rc = ul_serve_load(fd, req.len);
+        } else if (req.op == UL_SERVE_RUN && req.len == 0) {
+            rc = ul_serve_run(fd, req.id, req.fuel);
+        } else {
+            ul_serve_end(fd, UL_SERVE_EPROTO);
+            break;
+        }
+        if (rc < 0) {
+            break;
+        }
+    }
+    close(fd);
+}
+
+static void *ul_serve_thread(void *arg) {
+    int lfd = *(int *) arg, fd;
+
+    for (;;) {
+        if ((fd = accept(lfd, NULL, NULL)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            ul_panic("accept: %s", strerror(errno));
+        }
+        ul_serve_conn(fd);
+    }
+    return NULL;
+}
+
+static void __attribute__((noreturn)) ul_serve(const char *path, int n_threads, long fuel, long pause) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    pthread_t thread;
+    int lfd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        ul_panic("socket path too long");
+    }
+    strcpy(addr.sun_path, path);
+    if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(lfd, SOMAXCONN) < 0) {
+        ul_panic("%s: %s", path, strerror(errno));
+    }
+    ul_serve_fuel = fuel;
+    ul_serve_pause = pause;
+    for (int i = 1; i < n_threads; i++) {
+        if ((errno = pthread_create(&thread, NULL, ul_serve_thread, &lfd))) {
+            ul_panic("pthread_create: %s", strerror(errno));
+        }
+    }
+    ul_serve_thread(&lfd);
+    exit(0);
+}
+
+/* The exit status of ul after a run. */
+static int ul_exit_status(int status) {
+    switch (status) {
+    case UL_RUN_FUEL:
+        fflush(stdout);
+        fputs("ul: out of fuel\n", stderr);
+        return 2;
+    case UL_RUN_OOM:
+        ul_panic("out of memory");
+    case UL_RUN_STACK:
+        ul_panic("stack overflow");
+    }
+    return 0;
+}
+
+/* Fork mode. ul -i compiles the program once and runs the first warm
+ * applications of it, then forks a child per input that goes on from there
+ * with stdin from the input and stdout to the input with .out appended. The
+ * children share the code and the heap of the parent copy-on-write, and each
+ * prints whatever was printed before the fork first. */
+typedef struct {
+    pid_t pid;
+    double start;
+} ul_child_t;
+
+static double ul_now_ms(void) {
+    return ul_now_ns() / 1e6;
+}
+
+static int ul_child(ul_ctx_t *ctx, const char *input, int status, const char *pre, size_t n_pre, long fuel) {
+    char *path = malloc(strlen(input) + sizeof(".out"));
+    int fd;
+
+    if (!path) {
+        ul_panic("out of memory");
+    }
+    sprintf(path, "%s.out", input);
+    if ((fd = open(input, O_RDONLY)) < 0 || dup2(fd, STDIN_FILENO) < 0) {
+        perror(input);
+        return 1;
+    }
+    close(fd);
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+        perror(path);
+        return 1;
+    }
+    close(fd);
+    free(path);
+    fwrite(pre, 1, n_pre, stdout);
+    if (status == UL_RUN_FUEL) {
+        ctx->fuel = fuel;
+        status = ul_run(ctx);
+    }
+    return ul_exit_status(status);
+}
+
+/* Prints the exit status and latency of every child, returning the worst
+ * exit status. */
+static int ul_fork_inputs(ul_ctx_t *ctx, char **inputs, int n, int parallel, long warm, long fuel) {
+    char *pre = NULL;
+    size_t n_pre = 0;
+    int status = UL_RUN_FUEL, rc = 0, running = 0, code, i, j;
+    double start = ul_now_ms();
+    ul_child_t *children;
+    FILE *out;
+    pid_t pid;
+
+    if (warm) {
+        if (!(out = open_memstream(&pre, &n_pre))) {
+            ul_panic("out of memory");
+        }
+        ctx->out = out;
+        ctx->fuel = warm < fuel ? warm : fuel;
+        fuel -= ctx->fuel;
+        if ((status = ul_run(ctx)) != UL_RUN_HALT && status != UL_RUN_FUEL) {
+            ul_exit_status(status);
+        }
+        fclose(out);
+        ctx->out = stdout;
+    }
+    if (!(children = malloc(n * sizeof(ul_child_t)))) {
+        ul_panic("out of memory");
+    }
+    for (i = 0; i < n || running; ) {
+        if (i < n && running < parallel) {
+            fflush(stdout);
+            children[i].start = ul_now_ms();
+            if ((children[i].pid = fork()) < 0) {
+                ul_panic("fork: %s", strerror(errno));
+            } else if (!children[i].pid) {
+                exit(ul_child(ctx, inputs[i], status, pre, n_pre, fuel));
+            }
+            i++;
+            running++;
+            continue;
+        }
+        if ((pid = wait(&code)) < 0) {
+            ul_panic("wait: %s", strerror(errno));
+        }
+        for (j = 0; children[j].pid != pid; j++) {
+        }
+        running--;
+        code = WIFEXITED(code) ? WEXITSTATUS(code) : 128 + WTERMSIG(code);
+        printf("%s %d %.3f ms\n", inputs[j], code, ul_now_ms() - children[j].start);
+        if (code > rc) {
+            rc = code;
+        }
+    }
+    printf("%d inputs in %.3f ms\n", n, ul_now_ms() - start);
+    free(children);
+    free(pre);
+    return rc;
+}
+
+/* The pause below which a fraction q of the pauses of ctx are, to within
+ * its bucket. */
+static double ul_pause_ms(ul_ctx_t *ctx, double q) {
+    ul_pauses_t *p = &ctx->gc_pauses;
+    size_t n = 0, b;
+    uint64_t ns;
+
+    for (b = 0; b < UL_PAUSE_BUCKETS - 1 && (n += p->hist[b]) < q * p->n; b++) {
+    }
+    ns = b < 4 ? b : ((5 + b % 4) << (b / 4 - 1)) - 1;
+    return (ns < p->max ? ns : p->max) / 1e6;
+}
+
+static void ul_pauses_print(ul_ctx_t *ctx) {
+    ul_pauses_t *p = &ctx->gc_pauses;
+
+    fprintf(stderr, "gc: %zu pauses, %.3f ms in all\n", p->n, p->total / 1e6);
+    fprintf(stderr, "gc: p50 %.3f p90 %.3f p99 %.3f p99.9 %.3f max %.3f ms\n",
+            ul_pause_ms(ctx, 0.5), ul_pause_ms(ctx, 0.9), ul_pause_ms(ctx, 0.99),
+            ul_pause_ms(ctx, 0.999), p->max / 1e6);
+}
+
+#ifdef UL_STATS
+static void ul_stats_print(ul_ctx_t *ctx, int json) {
+    ul_stats_t *s = &ctx->stats;
+    size_t total = s->partial;
+
+    for (int i = 0; i < UL_N_COMBS; i++) {
+        total += s->reductions[i];
+    }
+    if (json) {
+        fprintf(stderr, "{\"reductions\": %zu, \"by_kind\": {", total);
+        for (int i = 0; i < UL_N_COMBS; i++) {
+            fprintf(stderr, "%s\"%s\": %zu", i ? ", " : "", ul_comb_names[i], s->reductions[i]);
+        }
+        fprintf(stderr, "}, \"partial\": %zu, \"alloc_objects\": %zu, \"alloc_bytes\": %zu, "
+                        "\"gcs\": %zu, \"gc_cycles\": %zu, \"gc_steps\": %zu, \"gc_copied\": %zu, "
+                        "\"gc_ms\": %.3f, \"gc_max_ms\": %.3f, \"heap_peak\": %zu, \"live_peak\": %zu, "
+                        "\"stack_peak\": %zu}\n",
+                s->partial, s->alloc_objects, s->alloc_bytes, s->gcs, s->gc_cycles, s->gc_steps,
+                s->gc_copied, ctx->gc_pauses.total / 1e6, ctx->gc_pauses.max / 1e6, s->heap_peak,
+                s->live_peak, s->stack_peak);
+        return;
+    }
+    fprintf(stderr, "stats: %zu reductions:", total);
+    for (int i = 0; i < UL_N_COMBS; i++) {
+        fprintf(stderr, " %s %zu", ul_comb_names[i], s->reductions[i]);
+    }
+    fprintf(stderr, " partial %zu\n", s->partial);
+    fprintf(stderr, "stats: %zu objects, %zu bytes allocated\n", s->alloc_objects, s->alloc_bytes);
+    fprintf(stderr, "stats: %zu collections, %zu incremental in %zu steps, %zu bytes copied, %.3f ms\n",
+            s->gcs, s->gc_cycles, s->gc_steps, s->gc_copied, ctx->gc_pauses.total / 1e6);
+    fprintf(stderr, "stats: heap up to %zu bytes, %zu live, stack up to at least %zu values\n",
+            s->heap_peak, s->live_peak, s->stack_peak);
+}
+#endif
+
+#ifdef UL_TRACE
+/* --trace=out records every application the program makes in out, laid out
+ * as in ul_trace.h for ul_trace to read back. The records go into a ring
+ * small enough to stay in the cache, which is written out whenever it
+ * fills. Storing them straight into the file mapped shared cost more than
+ * twice as much, for the faults on every page. Built in but not asked for,
+ * tracing costs a test per application. */
+#define UL_TRACE_RING 4096 /* records */
+
+static ul_ctx_t *ul_trace_ctx; /* to close the trace at exit */
+
+static void ul_trace_stop(ul_ctx_t *ctx) {
+    free(ctx->trace_ring);
+    ctx->trace_ring = ctx->trace_p = ctx->trace_end = NULL;
+}
+
+static int ul_trace_write(int fd, const void *buf, size_t len) {
+    ssize_t n;
+    while (len) {
+        if ((n = write(fd, buf, len)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf = (const uint8_t *) buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Write out the ring, and start it over. Tracing stops if the file cannot
+ * take it. */
+static ul_trace_rec_t *ul_trace_drain(ul_ctx_t *ctx) {
+    if (ul_trace_write(ctx->trace_fd, ctx->trace_ring, (ctx->trace_p - ctx->trace_ring) * sizeof(ul_trace_rec_t)) < 0) {
+        fprintf(stderr, "ul: trace stopped: %s\n", strerror(errno));
+        ul_trace_stop(ctx);
+        return NULL;
+    }
+    return ctx->trace_p = ctx->trace_ring;
+}
+
+static void ul_trace_start(ul_ctx_t *ctx, const char *file) {
+    char buf[UL_TRACE_HDR_SIZE] = { 0 };
+    ul_trace_hdr_t *hdr = (ul_trace_hdr_t *) buf;
+
+    memcpy(hdr->magic, UL_TRACE_MAGIC, sizeof(hdr->magic));
+    hdr->version = UL_TRACE_VERSION;
+    hdr->rec_size = sizeof(ul_trace_rec_t);
+    for (int i = 0; i < UL_N_COMBS; i++) {
+        strncpy(hdr->kinds[i], ul_comb_names[i], UL_TRACE_NAME - 1);
+    }
+    if (!(ctx->trace_ring = malloc(UL_TRACE_RING * sizeof(ul_trace_rec_t)))) {
+        ul_panic("out of memory");
+    }
+    if ((ctx->trace_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 ||
+        ul_trace_write(ctx->trace_fd, buf, sizeof(buf)) < 0) {
+        ul_panic("cannot write trace %s: %s", file, strerror(errno));
+    }
+    ctx->trace_p = ctx->trace_ring;
+    ctx->trace_end = ctx->trace_ring + UL_TRACE_RING;
+    ul_trace_ctx = ctx;
+}
+
+static void ul_trace_close(ul_ctx_t *ctx) {
+    if (ctx->trace_fd < 0) {
+        return;
+    }
+    if (ctx->trace_ring) {
+        ul_trace_drain(ctx);
+    }
+    if (close(ctx->trace_fd) < 0) {
+        fprintf(stderr, "ul: cannot write trace: %s\n", strerror(errno));
+    }
+    ul_trace_stop(ctx);
+    ctx->trace_fd = -1;
+    ul_trace_ctx = NULL;
+}
+
+static void ul_trace_exit(void) {
+    if (ul_trace_ctx) {
+        ul_trace_close(ul_trace_ctx);
+    }
+}
+
+static void ul_trace_signal(int sig) {
+    exit(128 + sig);
+}
+#endif
+
+#ifdef UL_PROF
+/* Sampling profiler, with -DUL_PROF. Every UL_PROF_USEC of CPU time, SIGPROF
+ * records the offset of the instruction the program is at, or was last at
+ * along with the kind of closure it is applying. At exit each sample goes
+ * to the unit of code it falls in, and through the ast the unit was
+ * compiled from to a place in the program text. The profile is written in
+ * collapsed stack format for flamegraph.pl and the like: a line for each
+ * unit sampled, under the units around it in the text, each shown as its
+ * offset and first few characters, with the time spent applying closures
+ * under it by kind. */
+#define UL_PROF_USEC 1000
+#define UL_PROF_SAMPLES (1 << 20)
+
+/* n[0] is in the code of the unit, n[1 + kind] applying a closure */
+typedef struct {
+    ul_ast_t *ast;
+    size_t n[1 + UL_N_COMBS];
+} ul_prof_site_t;
+
+static ul_ctx_t *ul_prof_ctx;
+static const char *ul_prof_text, *ul_prof_file;
+static uint64_t *ul_prof_samples; /* the offset of the pc, then the kind */
+static volatile size_t ul_prof_n, ul_prof_lost;
+
+static void ul_prof_tick(int sig) {
+    uint8_t *pc = ul_prof_pc, *bc = ul_prof_ctx->ul_bc.data;
+
+    if (pc >= bc && pc < bc + dynbuf_size(&ul_prof_ctx->ul_bc) && ul_prof_n < UL_PROF_SAMPLES) {
+        ul_prof_samples[ul_prof_n++] = (uint64_t) (pc - bc) << 8 | ul_prof_kind;
+    } else {
+        ul_prof_lost++;
+    }
+}
+
+static int ul_prof_site_cmp(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t) ((ul_prof_site_t *) a)->ast, y = (uintptr_t) ((ul_prof_site_t *) b)->ast;
+    return x < y ? -1 : x > y;
+}
+
+/* Write a line for every unit sampled under ast, path holding the units
+ * around it. */
+static void ul_prof_walk(FILE *out, ul_ast_t *ast, ul_prof_site_t *sites, size_t n_sites, dynbuf_t *path) {
+    ul_prof_site_t key = { .ast = ast }, *site = bsearch(&key, sites, n_sites, sizeof(key), ul_prof_site_cmp);
+    ul_ast_t **frames;
+
+    if (site && dynbuf_put(path, (uint8_t *) &ast, sizeof(ast)) < 0) {
+        site = NULL;
+    }
+    for (int k = 0; site && k < 1 + UL_N_COMBS; k++) {
+        if (!site->n[k]) {
+            continue;
+        }
+        frames = (ul_ast_t **) path->data;
+        for (size_t i = 0; i < dynbuf_size(path) / sizeof(ast); i++) {
+            if (i) {
+                putc(';', out);
+            }
+            ul_unit_show(out, ul_prof_text, frames[i]);
+        }
+        if (k) {
+            fprintf(out, ";[%s]", ul_comb_names[k - 1]);
+        }
+        fprintf(out, " %zu\n", site->n[k]);
+    }
+    if (ul_ast_is_app(ast)) {
+        ul_prof_walk(out, ast->u.rator, sites, n_sites, path);
+        for (size_t i = 0; i < ast->nrands; i++) {
+            ul_prof_walk(out, ast->rands[i], sites, n_sites, path);
+        }
+    }
+    if (site) {
+        path->size -= sizeof(ast);
+    }
+}
+
+static int ul_prof_sample_cmp(const void *a, const void *b) {
+    uint64_t x = *(uint64_t *) a, y = *(uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void ul_prof_dump(void) {
+    struct itimerval off = { { 0, 0 }, { 0, 0 } };
+    ul_ctx_t *ctx = ul_prof_ctx;
+    size_t n_sites, u = 0, n;
+    ul_prof_site_t *sites;
+    dynbuf_t path;
+    FILE *out;
+
+    if (!ul_prof_samples) {
+        return;
+    }
+    setitimer(ITIMER_PROF, &off, NULL);
+    n = ul_prof_n;
+    n_sites = dynbuf_size(&ctx->ul_units) / (2 * sizeof(size_t));
+    if (!(sites = calloc(n_sites ? n_sites : 1, sizeof(*sites))) || !(out = fopen(ul_prof_file, "w"))) {
+        fprintf(stderr, "ul: cannot write profile %s\n", ul_prof_file);
+        goto out;
+    }
+    /* the units are in the order of their offsets, and so are the samples
+     * once sorted */
+    qsort(ul_prof_samples, n, sizeof(*ul_prof_samples), ul_prof_sample_cmp);
+    for (size_t i = 0; i < n_sites; i++) {
+        size_t *unit = (size_t *) ctx->ul_units.data + 2 * i, end;
+        end = i + 1 < n_sites ? unit[2] : SIZE_MAX;
+        sites[i].ast = (ul_ast_t *) unit[1];
+        for (; u < n && ul_prof_samples[u] >> 8 < end; u++) {
+            sites[i].n[ul_prof_samples[u] & 0xff]++;
+        }
+    }
+    qsort(sites, n_sites, sizeof(*sites), ul_prof_site_cmp);
+    dynbuf_init(&path);
+    ul_prof_walk(out, ctx->ast, sites, n_sites, &path);
+    dynbuf_free(&path);
+    if (fclose(out) == EOF) {
+        fprintf(stderr, "ul: cannot write profile %s\n", ul_prof_file);
+    } else {
+        fprintf(stderr, "ul: %zu samples in %s, %zu outside of the code\n", n, ul_prof_file, ul_prof_lost);
+    }
+out:
+    free(sites);
+    free(ul_prof_samples);
+    ul_prof_samples = NULL;
+}
+
+static void ul_prof_exit(int sig) {
+    exit(128 + sig);
+}
+
+static void ul_prof_start(ul_ctx_t *ctx, const char *text, const char *file) {
+    struct itimerval every = { { 0, UL_PROF_USEC }, { 0, UL_PROF_USEC } };
+    struct sigaction sa;
+
+    if (!text) {
+        ul_panic("--profile needs the program text");
+    }
+    if (!(ul_prof_samples = malloc(UL_PROF_SAMPLES * sizeof(*ul_prof_samples)))) {
+        ul_panic("out of memory");
+    }
+    ul_prof_ctx = ctx;
+    ul_prof_text = text;
+    ul_prof_file = file;
+    atexit(ul_prof_dump);
+    signal(SIGINT, ul_prof_exit);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = ul_prof_tick;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL) < 0 || setitimer(ITIMER_PROF, &every, NULL) < 0) {
+        ul_panic("cannot start the profiler: %s", strerror(errno));
+    }
+}
+#endif
+
+int main(int argc, char *argv[]) {
+    ul_ctx_t ctx;
+    FILE *in = stdin;
+    char *text;
+    long fuel = LONG_MAX;
+    long warm = 0, pause = 0, stack_max = 0;
+    const char *sock = NULL, *image = NULL, *ckpt = NULL, *prof = NULL, *census = NULL, *trace = NULL;
+    int n_threads = 4, gc_threads = 1, inputs = 0, verbose = 0, stats = 0;
+    int opt, rc;
+    static const struct option longopts[] = {
+        { "stats", optional_argument, NULL, 'S' },
+        { "profile", required_argument, NULL, 'P' },
+        { "census", required_argument, NULL, 'C' },
+        { "trace", required_argument, NULL, 'T' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    while ((opt = getopt_long(argc, argv, "f:g:ij:k:m:o:p:s:vw:", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'f':
+            if ((fuel = atol(optarg)) <= 0) {
+                goto usage;
+            }
+            break;
+        case 'g':
+            if ((gc_threads = atoi(optarg)) <= 0) {
+                goto usage;
+            }
+            break;
+        case 'j':
+            if ((n_threads = atoi(optarg)) <= 0) {
+                goto usage;
+            }
+            break;
+        case 'i':
+            inputs = 1;
+            break;
+        case 'k':
+            ckpt = optarg;
+            break;
+        case 'm':
+            if ((stack_max = atol(optarg)) <= 0) {
+                goto usage;
+            }
+            break;
+        case 'o':
+            image = optarg;
+            break;
+        case 'p':
+            if ((pause = atol(optarg)) <= 0) {
+                goto usage;
+            }
+            pause *= 1000;
+            break;
+        case 's':
+            sock = optarg;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'S':
+            if (optarg && strcmp(optarg, "json")) {
+                goto usage;
+            }
+            stats = optarg ? 2 : 1;
+            break;
+        case 'P':
+            prof = optarg;
+            break;
+        case 'C':
+            census = optarg;
+            break;
+        case 'T':
+            trace = optarg;
+            break;
+        case 'w':
+            if ((warm = atol(optarg)) < 0) {
+                goto usage;
+            }
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (((ckpt || prof || census || trace) && (sock || image || inputs)) ||
+        (inputs ? sock || image || argc - optind < 2 : argc - optind > (sock ? 0 : 1))) {
+        goto usage;
+    }
+    if (sock) {
+        ul_serve(sock, n_threads, fuel, pause);
+    }
+#ifndef UL_STATS
+    if (stats) {
+        ul_panic("--stats needs a build with -DUL_STATS");
+    }
+#endif
+#ifndef UL_PROF
+    if (prof) {
+        ul_panic("--profile needs a build with -DUL_PROF");
+    }
+#endif
+#ifndef UL_CENSUS
+    if (census) {
+        ul_panic("--census needs a build with -DUL_CENSUS");
+    }
+#endif
+#ifndef UL_TRACE
+    if (trace) {
+        ul_panic("--trace needs a build with -DUL_TRACE");
+    }
+#endif
+    if (optind < argc && !(in = fopen(argv[optind], "r"))) {
+        perror(argv[optind]);
+        return 1;
+    }
+#ifdef UL_OPSTATS
+    atexit(ul_opstats_dump);
+    signal(SIGINT, ul_opstats_exit);
+#endif
+    if (ul_ctx_init(&ctx, UL_HEAP_SIZE, UL_STACK_SIZE) < 0) {
+        ul_panic("cannot map heap");
+    }
+    if (stack_max) {
+        ctx.stack_max = stack_max;
+    }
+    /* more collector threads than CPUs only get in each other's way */
+    if (gc_threads > sysconf(_SC_NPROCESSORS_ONLN)) {
+        gc_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    ctx.gc_threads = gc_threads;
+    ctx.gc_pause = pause;
+    if ((rc = ul_ctx_load_image(&ctx, fileno(in))) < 0) {
+        ul_panic("bad image");
+    } else if (rc == 0) {
+        if (image) {
+            ul_panic("already an image");
+        }
+        text = NULL;
+    } else {
+        if (!(text = ul_read_file(in))) {
+            ul_panic("cannot read program");
+        }
+        ul_parse_state_t state = {text, UL_PARSE_OK};
+        if (!(ctx.ast = ul_parse_prog(&state))) {
+            ul_panic("parse error %d", state.error);
+        }
+        if (ul_compile(&ctx, ctx.ast, hlt) < 0) {
+            ul_panic("out of memory");
+        }
+    }
+    if (image) {
+        FILE *out = fopen(image, "w");
+        if (!out) {
+            perror(image);
+            return 1;
+        }
+        if (ul_image_write(&ctx, out, 0) < 0 || fclose(out) == EOF) {
+            unlink(image);
+            ul_panic("cannot write image");
+        }
+        return 0;
+    }
+    if (inputs) {
+        return ul_fork_inputs(&ctx, argv + optind + 1, argc - optind - 1, n_threads, warm, fuel);
+    }
+    ctx.fuel = fuel;
+#ifdef UL_PROF
+    if (prof) {
+        ul_prof_start(&ctx, text, prof);
+    }
+#endif
+#ifdef UL_CENSUS
+    if (census) {
+        ul_census_start(&ctx, text, census);
+    }
+#endif
+#ifdef UL_TRACE
+    if (trace) {
+        ul_trace_start(&ctx, trace);
+        atexit(ul_trace_exit);
+        signal(SIGINT, ul_trace_signal);
+    }
+#endif
+    if ((rc = ul_run(&ctx)) == UL_RUN_FUEL && ckpt) {
+        FILE *out = fopen(ckpt, "w");
+        fflush(stdout);
+        if (!out) {
+            perror(ckpt);
+            return 1;
+        }
+        if (ul_checkpoint(&ctx, out) < 0 || fclose(out) == EOF) {
+            unlink(ckpt);
+            ul_panic("cannot write checkpoint");
+        }
+    }
+    if (verbose) {
+        ul_pauses_print(&ctx);
+    }
+#ifdef UL_PROF
+    ul_prof_dump();
+#endif
+#ifdef UL_CENSUS
+    if (census && fclose(ctx.census) == EOF) {
+        fprintf(stderr, "ul: cannot write census %s\n", census);
+    }
+    ctx.census = NULL;
+#endif
+#ifdef UL_TRACE
+    ul_trace_close(&ctx);
+#endif
+#ifdef UL_STATS
+    UL_STATS_STACK(&ctx, ctx.sp);
+    if (stats) {
+        ul_stats_print(&ctx, stats == 2);
+    }
+#endif
+    if ((rc = ul_exit_status(rc))) {
+        return rc;
+    }
+    ul_ctx_destroy(&ctx);
+    free(text);
+    return 0;
+usage:
+    fprintf(stderr, "usage: %s [-f fuel [-k checkpoint]] [-g gcthreads] [-m maxstack] [-p pause] [-v] [--stats[=json]] [--profile=out] [--census=out] [--trace=out] [file]\n"
+                    "       %s -o image [file]\n"
+                    "       %s -s socket [-f fuel] [-j threads] [-p pause]\n"
+                    "       %s -i [-f fuel] [-g gcthreads] [-j children] [-m maxstack] [-p pause] [-w warmup] file input...\n",
+            argv[0], argv[0], argv[0], argv[0]);
+    return 1;
+}
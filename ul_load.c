@@ -0,0 +1,316 @@
+/* Load generator for the ul server.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 Zeling Feng
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dynbuf.h"
+#include "ul_serve.h"
+
+/* Every connection loads the program and then runs it until runs_left is
+ * used up, keeping the latency of each run. With -v the output of the runs
+ * is written to stdout. */
+static const char *ul_sock;
+static char *ul_text;
+static size_t ul_text_len;
+static long ul_fuel;
+static int ul_verbose;
+static long ul_runs_left;
+static long ul_failed;
+static size_t ul_out_bytes;
+static pthread_mutex_t ul_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+    double *lat;
+    size_t n_lat;
+    int error;
+} ul_conn_t;
+
+static double ul_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int ul_read_full(int fd, void *buf, size_t len) {
+    ssize_t n;
+    while (len) {
+        if ((n = read(fd, buf, len)) <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf = (uint8_t *) buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int ul_write_full(int fd, const void *buf, size_t len) {
+    ssize_t n;
+    while (len) {
+        if ((n = write(fd, buf, len)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf = (const uint8_t *) buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Read a reply, its data going to buf which has room for cap bytes. */
+static int ul_reply(int fd, ul_serve_rep_t *rep, void *buf, size_t cap) {
+    if (ul_read_full(fd, rep, sizeof(*rep)) < 0 || rep->len > cap) {
+        return -1;
+    }
+    return ul_read_full(fd, buf, rep->len);
+}
+
+static int ul_connect(void) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    strncpy(addr.sun_path, ul_sock, sizeof(addr.sun_path) - 1);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Returns the status of the run, or -1 if the connection broke. */
+static int ul_run_once(int fd, uint64_t id) {
+    ul_serve_req_t req = { .op = UL_SERVE_RUN, .id = id, .fuel = ul_fuel };
+    ul_serve_rep_t rep;
+    char buf[65536];
+    size_t bytes = 0;
+    uint32_t status;
+
+    if (ul_write_full(fd, &req, sizeof(req)) < 0) {
+        return -1;
+    }
+    for (;;) {
+        if (ul_reply(fd, &rep, buf, sizeof(buf)) < 0) {
+            return -1;
+        }
+        if (rep.type == UL_SERVE_END) {
+            break;
+        }
+        bytes += rep.len;
+        if (ul_verbose) {
+            pthread_mutex_lock(&ul_lock);
+            fwrite(buf, 1, rep.len, stdout);
+            pthread_mutex_unlock(&ul_lock);
+        }
+    }
+    pthread_mutex_lock(&ul_lock);
+    ul_out_bytes += bytes;
+    pthread_mutex_unlock(&ul_lock);
+    memcpy(&status, buf, sizeof(status));
+    return status;
+}
+
+static void *ul_conn_main(void *arg) {
+    ul_conn_t *conn = arg;
+    ul_serve_req_t req = { .op = UL_SERVE_LOAD, .len = ul_text_len };
+    ul_serve_rep_t rep;
+    uint64_t id;
+    int fd, status;
+    double start;
+
+    if ((fd = ul_connect()) < 0) {
+        perror(ul_sock);
+        conn->error = 1;
+        return NULL;
+    }
+    if (ul_write_full(fd, &req, sizeof(req)) < 0 || ul_write_full(fd, ul_text, ul_text_len) < 0 ||
+        ul_reply(fd, &rep, &id, sizeof(id)) < 0) {
+        fputs("ul_load: connection broken\n", stderr);
+        conn->error = 1;
+        goto out;
+    }
+    if (rep.type != UL_SERVE_ID) {
+        uint32_t err;
+        memcpy(&err, &id, sizeof(err));
+        fprintf(stderr, "ul_load: cannot load program: status %u\n", err);
+        conn->error = 1;
+        goto out;
+    }
+    for (;;) {
+        pthread_mutex_lock(&ul_lock);
+        if (ul_runs_left == 0) {
+            pthread_mutex_unlock(&ul_lock);
+            break;
+        }
+        ul_runs_left--;
+        pthread_mutex_unlock(&ul_lock);
+        start = ul_now();
+        if ((status = ul_run_once(fd, id)) < 0) {
+            fputs("ul_load: connection broken\n", stderr);
+            conn->error = 1;
+            break;
+        }
+        conn->lat[conn->n_lat++] = ul_now() - start;
+        if (status != UL_SERVE_OK) {
+            pthread_mutex_lock(&ul_lock);
+            ul_failed++;
+            pthread_mutex_unlock(&ul_lock);
+        }
+    }
+out:
+    close(fd);
+    return NULL;
+}
+
+static int ul_cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+static char *ul_read_file(FILE *in) {
+    dynbuf_t buf;
+    char chunk[4096];
+    size_t n;
+
+    dynbuf_init(&buf);
+    while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+        if (dynbuf_put(&buf, (uint8_t *) chunk, n) < 0) {
+            goto error;
+        }
+    }
+    if (ferror(in) || dynbuf_put_uint8_t(&buf, 0) < 0) {
+        goto error;
+    }
+    return (char *) buf.data;
+error:
+    dynbuf_free(&buf);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    long n_runs = 1000;
+    int n_conns = 1, error = 0, opt;
+    ul_conn_t *conns;
+    pthread_t *threads;
+    double start, ms, *lat;
+    size_t n_lat = 0;
+    FILE *in;
+
+    while ((opt = getopt(argc, argv, "c:n:f:v")) != -1) {
+        switch (opt) {
+        case 'c':
+            if ((n_conns = atoi(optarg)) <= 0) {
+                goto usage;
+            }
+            break;
+        case 'n':
+            if ((n_runs = atol(optarg)) <= 0) {
+                goto usage;
+            }
+            break;
+        case 'f':
+            if ((ul_fuel = atol(optarg)) <= 0) {
+                goto usage;
+            }
+            break;
+        case 'v':
+            ul_verbose = 1;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (argc - optind != 2) {
+        goto usage;
+    }
+    ul_sock = argv[optind];
+    if (!(in = fopen(argv[optind + 1], "r"))) {
+        perror(argv[optind + 1]);
+        return 1;
+    }
+    if (!(ul_text = ul_read_file(in))) {
+        fputs("ul_load: cannot read program\n", stderr);
+        return 1;
+    }
+    fclose(in);
+    ul_text_len = strlen(ul_text);
+    ul_runs_left = n_runs;
+    conns = calloc(n_conns, sizeof(ul_conn_t));
+    threads = malloc(n_conns * sizeof(pthread_t));
+    lat = malloc(n_runs * sizeof(double));
+    if (!conns || !threads || !lat) {
+        fputs("ul_load: out of memory\n", stderr);
+        return 1;
+    }
+    start = ul_now();
+    for (int i = 0; i < n_conns; i++) {
+        if (!(conns[i].lat = malloc(n_runs * sizeof(double))) ||
+            pthread_create(&threads[i], NULL, ul_conn_main, &conns[i])) {
+            fputs("ul_load: cannot start connection\n", stderr);
+            return 1;
+        }
+    }
+    for (int i = 0; i < n_conns; i++) {
+        pthread_join(threads[i], NULL);
+        memcpy(lat + n_lat, conns[i].lat, conns[i].n_lat * sizeof(double));
+        n_lat += conns[i].n_lat;
+        error |= conns[i].error;
+        free(conns[i].lat);
+    }
+    ms = ul_now() - start;
+    if (!ul_verbose && n_lat) {
+        double sum = 0;
+        qsort(lat, n_lat, sizeof(double), ul_cmp_double);
+        for (size_t i = 0; i < n_lat; i++) {
+            sum += lat[i];
+        }
+        printf("%zu runs (%ld failed), %zu bytes out in %.1f ms: %.0f runs/s\n",
+               n_lat, ul_failed, ul_out_bytes, ms, n_lat / ms * 1e3);
+        printf("latency ms: mean %.3f p50 %.3f p99 %.3f max %.3f\n", sum / n_lat,
+               lat[n_lat / 2], lat[n_lat * 99 / 100], lat[n_lat - 1]);
+    }
+    free(lat);
+    free(threads);
+    free(conns);
+    free(ul_text);
+    return error || ul_failed ? 1 : 0;
+usage:
+    fprintf(stderr, "usage: %s [-c connections] [-n runs] [-f fuel] [-v] socket file\n", argv[0]);
+    return 1;
+}
@@ -37,11 +37,12 @@ int ul_ast_is_app(ul_ast_t *ast)
     return !ul_ast_is_atom(ast);
 }
 
-ul_ast_t *ul_ast_mk_atom(ul_atom_t atom)
+ul_ast_t *ul_ast_mk_atom(ul_atom_t atom, size_t off)
 {
     ul_ast_t *ast = (ul_ast_t *)malloc(sizeof(ul_ast_t));
     if (!ast)
         return NULL;
+    ast->off = off;
     ast->nrands = 0;
     ast->u.atom = atom;
     return ast;
@@ -59,6 +60,7 @@ ul_ast_t *ul_parse_atom(ul_parse_state_t *state)
 {
     skip_whitespace(state);
     char *p = state->text;
+    size_t off = p - state->base;
     ul_ast_t *ast = NULL;
     if (!*p) {
         state->error = UL_PARSE_EOF;
@@ -66,32 +68,32 @@ ul_ast_t *ul_parse_atom(ul_parse_state_t *state)
     }
     switch (*p++) {
     case 's':
-        ast = ul_ast_mk_atom(UL_S);
+        ast = ul_ast_mk_atom(UL_S, off);
         break;
     case 'k':
-        ast = ul_ast_mk_atom(UL_K);
+        ast = ul_ast_mk_atom(UL_K, off);
         break;
     case 'i':
-        ast = ul_ast_mk_atom(UL_I);
+        ast = ul_ast_mk_atom(UL_I, off);
         break;
     case 'd':
-        ast = ul_ast_mk_atom(UL_D);
+        ast = ul_ast_mk_atom(UL_D, off);
         break;
     case 'c':
-        ast = ul_ast_mk_atom(UL_C);
+        ast = ul_ast_mk_atom(UL_C, off);
         break;
     case 'v':
-        ast = ul_ast_mk_atom(UL_V);
+        ast = ul_ast_mk_atom(UL_V, off);
         break;
     case '.':
         if (!*p) {
             state->error = UL_PARSE_EOF;
             return NULL;
         }
-        ast = ul_ast_mk_atom(*p++);
+        ast = ul_ast_mk_atom(*p++, off);
         break;
     case 'r':
-        ast = ul_ast_mk_atom('\n');
+        ast = ul_ast_mk_atom('\n', off);
         break;
     default:
         state->error = UL_PARSE_UNRECOGNIZED;
@@ -104,6 +106,7 @@ ul_ast_t *ul_parse_atom(ul_parse_state_t *state)
 ul_ast_t *ul_parse_app(ul_parse_state_t *state)
 {
     skip_whitespace(state);
+    size_t off = state->text - state->base;
     size_t nrands = 1;
     while (*++state->text == '`') {
         skip_whitespace(state);
@@ -120,6 +123,7 @@ ul_ast_t *ul_parse_app(ul_parse_state_t *state)
         state->error = UL_PARSE_OOM;
         return NULL;
     }
+    ast->off = off;
     ast->nrands = nrands;
     ast->u.rator = rator;
     for (int i = 0; i < nrands; i++) {
@@ -148,6 +152,9 @@ void ul_ast_free(ul_ast_t *ast)
 
 ul_ast_t *ul_parse_prog(ul_parse_state_t *state)
 {
+    if (!state->base) {
+        state->base = state->text;
+    }
     skip_whitespace(state);
     if (!*state->text) {
         state->error = UL_PARSE_EOF;
@@ -52,6 +52,7 @@ typedef struct ul_ast {
         struct ul_ast *rator;
         ul_atom_t atom;
     } u;
+    size_t off; /* of the atom or the first ` in the program text */
     size_t nrands;
     struct ul_ast *rands[];
 } ul_ast_t;
@@ -59,6 +60,7 @@ typedef struct ul_ast {
 typedef struct ul_parse_state {
     char *text;
     int error;
+    char *base; /* where offsets count from, text as first parsed if NULL */
 } ul_parse_state_t;
 
 int ul_ast_is_atom(ul_ast_t *ast);
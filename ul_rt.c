@@ -24,13 +24,20 @@
  */
 #include <alloca.h>
 #include <assert.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/mman.h>
+#include <time.h>
 #include <ucontext.h>
+#include <unistd.h>
+
+#include "dynbuf.h"
+#include "ul_parse.h"
 
 #define ul_noreturn __attribute__((noreturn))
 #define ul_force_inline __attribute__((always_inline))
@@ -59,32 +66,147 @@ typedef struct ul_closure {
     ul_env_t env;
 } ul_closure_t;
 
+/* With -DUL_STATS, each task counts what it did for --stats: reductions by
+ * combinator and partial applications, allocations, collections, the bytes
+ * they copied and time they took, and the most that survived one. */
+#define UL_RT_COMB_LIST(T) T(S) T(K) T(I) T(V) T(C) T(D) T(Dot) T(Cont) T(Promise)
+
+enum {
+#define T(x) UL_RT_##x,
+    UL_RT_COMB_LIST(T)
+#undef T
+    UL_RT_N_COMBS
+};
+
+#ifdef UL_STATS
+typedef struct {
+    size_t reductions[UL_RT_N_COMBS];
+    size_t partial;
+    size_t alloc_objects;
+    size_t alloc_bytes;
+    size_t gcs;
+    size_t gc_copied;
+    uint64_t gc_ns;
+    size_t live_peak;
+} ul_stats_t;
+
+/* p is the address of anything on the stack of the task. */
+#define UL_STATS_ADD(p, what, n) (ul_task(p)->stats.what += (n))
+/* Count a reduction by combinator x of the running task. */
+#define UL_STATS_REDUCE(x) \
+    do { \
+        int dumb_; \
+        UL_STATS_ADD(&dumb_, reductions[UL_RT_##x], 1); \
+    } while (0)
+#else
+#define UL_STATS_ADD(p, what, n) ((void) 0)
+#define UL_STATS_REDUCE(x) ((void) 0)
+#endif
+
 #define ALLOC_CLOS(clos, fn, n_cap) \
     ul_closure_t *clos = alloca(sizeof(ul_closure_t) + N_CLOSURE(n_cap)); \
     clos->clos_fn = fn; \
-    clos->env.n_captured = (n_cap)
+    clos->env.n_captured = (n_cap); \
+    UL_STATS_ADD(clos, alloc_objects, 1); \
+    UL_STATS_ADD(clos, alloc_bytes, sizeof(ul_closure_t) + N_CLOSURE(n_cap))
 
 #define ALLOC_CONT(cont, fn, n_cap) \
     ul_closure_t *cont = alloca(sizeof(ul_closure_t) + N_CLOSURE(n_cap)); \
     cont->cont_fn = fn; \
-    cont->env.n_captured = n_cap
+    cont->env.n_captured = n_cap; \
+    UL_STATS_ADD(cont, alloc_objects, 1); \
+    UL_STATS_ADD(cont, alloc_bytes, sizeof(ul_closure_t) + N_CLOSURE(n_cap))
+
 
 static void ul_K(ul_closure_t *cont, ul_env_t *env, size_t n_args, ul_closure_t *args[]);
 static void ul_I(ul_closure_t *cont, ul_env_t *env, size_t n_args, ul_closure_t *args[]);
 static void ul_S(ul_closure_t *cont, ul_env_t *env, size_t n_args, ul_closure_t *args[]);
+static void ul_V(ul_closure_t *cont, ul_env_t *env, size_t n_args, ul_closure_t *args[]);
+static void ul_C(ul_closure_t *cont, ul_env_t *env, size_t n_args, ul_closure_t *args[]);
+static void ul_D(ul_closure_t *cont, ul_env_t *env, size_t n_args, ul_closure_t *args[]);
+static void ul_Dot(ul_closure_t *cont, ul_env_t *env, size_t n_args, ul_closure_t *args[]);
+static void ul_Cont(ul_closure_t *cont, ul_env_t *env, size_t n_args, ul_closure_t *args[]);
+static void ul_Promise(ul_closure_t *cont, ul_env_t *env, size_t n_args, ul_closure_t *args[]);
+
+/* Pointers to the program text are kept in captured slots as they are; the
+ * collector leaves everything outside of the from space alone. */
+#define AST(p) ((ul_closure_t *) (p))
+
+/* Tasks. Every program runs as a task on a pair of STK_SIZE semispaces of
+ * its own, aligned to STK_SIZE so that the task is found from the address of
+ * anything on its stack: the first word of either semispace points back to
+ * it, and gc never copies that far down. */
+#define STK_SIZE (64 * 1024)
+#define STK_GC_THRES 0x1000
+#define GC_STK_SIZE (16 * 1024)
+#define UL_OUT_SIZE 4096
+/* Applications a task runs before it gives way to the next one. It only
+ * does so on a collection, which comes around at least once every STK_SIZE
+ * bytes of applications. */
+#define UL_SLICE 20000
+
+/* Why a task went back to its worker. */
+enum {
+    UL_TASK_SLICE,  /* turn is over */
+    UL_TASK_OUT,    /* output buffer is full */
+    UL_TASK_HALT,
+    UL_TASK_FUEL,
+    UL_TASK_OOM,
+};
+
+struct ul_worker;
+
+typedef struct ul_task {
+    char *stk_from, *stk_to;
+    ucontext_t ctx;
+    ul_closure_t *gc_cont, *gc_clos;
+    /* Applications left, and what is left of them when the turn is over. */
+    long fuel, slice;
+    int state;
+    struct ul_worker *worker;
+    struct ul_task *next;
+    const char *name;
+    char *text;
+    ul_ast_t *ast;
+    ul_closure_t *start;
+#ifdef UL_STATS
+    ul_stats_t stats;
+#endif
+    size_t n_out;
+    char out[UL_OUT_SIZE];
+} ul_task_t;
+
+typedef struct ul_worker {
+    ucontext_t sched_ctx, gc_ctx;
+    ul_task_t *task;
+    char *allocp;
+    char gc_stk[GC_STK_SIZE];
+} ul_worker_t;
+
+/* sp is the address of some local; the asm keeps the compiler from taking
+ * what is read through it for that local. */
+static inline ul_force_inline ul_task_t *ul_task(void *sp) {
+    uintptr_t p = (uintptr_t) sp & ~(uintptr_t) (STK_SIZE - 1);
+    __asm__("" : "+r" (p));
+    return *(ul_task_t **) p;
+}
+
+static inline ul_force_inline size_t ul_stk_left(void *sp) {
+    return (uintptr_t) sp & (STK_SIZE - 1);
+}
+
+static void ul_yield(ul_task_t *t, int state) {
+    t->state = state;
+    swapcontext(&t->ctx, &t->worker->sched_ctx);
+}
 
 /* GC */
-static ul_closure_t *gc_cont, *gc_clos;
-static ucontext_t ul_ctx, gc_ctx;
-#define GC_STK_SIZE (16 * 1024)
-static char gc_stk[GC_STK_SIZE];
 static void gc(ul_closure_t *cont, ul_closure_t *clos);
-static void gc_main();
-static char *stk_to, *stk_from;
-#define STK_SIZE (64 * 1024)
-#define STK_GC_THRES 0x1000
+static void gc_main(ul_worker_t *w);
 
+static ul_closure_t ul_dots[256];
 
+#if DEBUG
 static void dump_clos(ul_closure_t *clos) {
     if (clos->clos_fn == &ul_K) {
         puts("K");
@@ -92,15 +214,28 @@ static void dump_clos(ul_closure_t *clos) {
         puts("S");
     } else if (clos->clos_fn == &ul_I) {
         puts("I");
+    } else if (clos->clos_fn == &ul_V) {
+        puts("V");
+    } else if (clos->clos_fn == &ul_C) {
+        puts("C");
+    } else if (clos->clos_fn == &ul_D) {
+        puts("D");
+    } else if (clos->clos_fn == &ul_Dot) {
+        printf(".%c\n", (int) (clos - ul_dots));
+    } else if (clos->clos_fn == &ul_Cont) {
+        puts("Cont");
+    } else if (clos->clos_fn == &ul_Promise) {
+        puts("Promise");
     } else {
         puts("Not possible");
         exit(1);
     }
 }
+#endif
 
 static inline ul_force_inline void apply_cont(ul_closure_t *cont, ul_closure_t *clos) {
     int dumb;
-    if ((uintptr_t) &dumb < (uintptr_t) stk_from + STK_GC_THRES) {
+    if (ul_stk_left(&dumb) < STK_GC_THRES) {
         gc(cont, clos);
     } else {
         cont->cont_fn(&cont->env, clos);
@@ -112,21 +247,22 @@ static void resume_application_cont_fn(ul_env_t *env, ul_closure_t *clos);
 static inline ul_force_inline void apply_clos(ul_closure_t *clos, ul_closure_t *cont, size_t n_args, ul_closure_t *args[]) {
     int dumb;
     #if DEBUG
-        printf("diff: %lu\n", (uintptr_t) &dumb - (uintptr_t) stk_from);
+        printf("diff: %lu\n", ul_stk_left(&dumb));
     #endif
-    if ((uintptr_t) &dumb < (uintptr_t) stk_from + STK_GC_THRES + sizeof(ul_closure_t) + N_CLOSURE(n_args + 2)) {
+    if (ul_stk_left(&dumb) < STK_GC_THRES + sizeof(ul_closure_t) + N_CLOSURE(n_args + 2)) {
         ALLOC_CONT(kont, &resume_application_cont_fn, n_args + 2);
         kont->env.captured[0] = clos;
         kont->env.captured[1] = cont;
         memcpy(kont->env.captured + 2, args, N_CLOSURE(n_args));
         gc(kont, NULL);
     } else {
-        if (clos->env.n_captured + n_args == 0) {
+        if (n_args == 0) {
             apply_cont(cont, clos);
         } else {
     #if DEBUG
             dump_clos(clos);
     #endif
+            ul_task(&dumb)->fuel--;
             clos->clos_fn(cont, &clos->env, n_args, args);
         }
     }
@@ -136,20 +272,46 @@ static void resume_application_cont_fn(ul_env_t *env, ul_closure_t *clos) {
     apply_clos(env->captured[0], env->captured[1], env->n_captured - 2, env->captured + 2);
 }
 
+/* The value passed to this continuation is applied to the captured
+ * arguments, captured[0] being the continuation of that application. */
+static void ul_apply_to_cont_fn(ul_env_t *env, ul_closure_t *clos) {
+    apply_clos(clos, env->captured[0], env->n_captured - 1, env->captured + 1);
+}
+
+/* captured[1] is applied to the value passed to this continuation followed
+ * by the rest of the captured arguments. */
+static void ul_apply_cont_fn(ul_env_t *env, ul_closure_t *clos) {
+    size_t n_args = env->n_captured - 1;
+    if (n_args == 1) {
+        return apply_clos(env->captured[1], env->captured[0], 1, &clos);
+    }
+    ul_closure_t **args = alloca(N_CLOSURE(n_args));
+    args[0] = clos;
+    memcpy(args + 1, env->captured + 2, N_CLOSURE(n_args - 1));
+    return apply_clos(env->captured[1], env->captured[0], n_args, args);
+}
+
+static inline ul_force_inline void ul_partial(ul_closure_fn fn, ul_closure_t *cont, ul_env_t *env, size_t n_args, ul_closure_t *args[]) {
+    ALLOC_CLOS(clos, fn, env->n_captured + n_args);
+    UL_STATS_ADD(clos, partial, 1);
+    memcpy(&clos->env.captured, env->captured, N_CLOSURE(env->n_captured));
+    memcpy(&clos->env.captured[env->n_captured], args, N_CLOSURE(n_args));
+    return apply_cont(cont, clos);
+}
+
 static void ul_K(ul_closure_t *cont, ul_env_t *env, size_t n_args, ul_closure_t *args[]) {
     assert(env->n_captured < 2);
     if (env->n_captured + n_args >= 2) {
         ul_closure_t *x = env->n_captured == 0? args[0] : env->captured[0];
+        UL_STATS_REDUCE(K);
         return apply_clos(x, cont, env->n_captured + n_args - 2, args + 2 - env->n_captured);
     } else {
-        ALLOC_CLOS(clos, &ul_K, env->n_captured + n_args);
-        memcpy(&clos->env.captured, env->captured, N_CLOSURE(env->n_captured));
-        memcpy(&clos->env.captured[env->n_captured], args, N_CLOSURE(n_args));
-        return apply_cont(cont, clos);
+        return ul_partial(&ul_K, cont, env, n_args, args);
     }
 }
 
-static void ul_I(ul_closure_t *cont, ul_env_t *env, size_t n_args, ul_closure_t *args[]) {
+/* Pass on the first argument: what I and every .x come down to. */
+static inline ul_force_inline void ul_pass(ul_closure_t *cont, size_t n_args, ul_closure_t *args[]) {
     if (n_args == 1) {
         return apply_cont(cont, args[0]);
     } else {
@@ -157,33 +319,111 @@ static void ul_I(ul_closure_t *cont, ul_env_t *env, size_t n_args, ul_closure_t
     }
 }
 
+static void ul_I(ul_closure_t *cont, ul_env_t *env, size_t n_args, ul_closure_t *args[]) {
+    UL_STATS_REDUCE(I);
+    return ul_pass(cont, n_args, args);
+}
+
+/* `xz` is evaluated before `yz`. The env is left as it is: under c a
+ * continuation may be resumed more than once. */
 static void ul_S_cont(ul_env_t *env, ul_closure_t *clos) {
-    ul_closure_t *cont = env->captured[0];
-    ul_closure_t *x = env->captured[1];
-    ul_closure_t *z = env->captured[2];
-    env->captured[1] = z;
-    env->captured[2] = clos;
-    return apply_clos(x, cont, env->n_captured - 1, env->captured + 1);
+    ALLOC_CONT(kont, &ul_apply_cont_fn, env->n_captured - 1);
+    kont->env.captured[0] = env->captured[0];
+    kont->env.captured[1] = clos;
+    memcpy(kont->env.captured + 2, env->captured + 3, N_CLOSURE(env->n_captured - 3));
+    return apply_clos(env->captured[1], kont, 1, &env->captured[2]);
 }
 
 static void ul_S(ul_closure_t *cont, ul_env_t *env, size_t n_args, ul_closure_t *args[]) {
     assert(env->n_captured < 3);
     if (env->n_captured + n_args >= 3) {
-        ul_closure_t *y, *z;
+        ul_closure_t *x;
+        UL_STATS_REDUCE(S);
         ALLOC_CONT(kont, &ul_S_cont, env->n_captured + n_args);
         kont->env.captured[0] = cont;
-        kont->env.captured[1] = env->n_captured == 0? args[0] : env->captured[0];
-        y = env->n_captured == 2? env->captured[1] : args[1 - env->n_captured];
-        z = kont->env.captured[2] = args[2 - env->n_captured];
-        return apply_clos(y, kont, 1, &z);
+        x = env->n_captured == 0? args[0] : env->captured[0];
+        kont->env.captured[1] = env->n_captured == 2? env->captured[1] : args[1 - env->n_captured];
+        kont->env.captured[2] = args[2 - env->n_captured];
+        memcpy(kont->env.captured + 3, args + 3 - env->n_captured, N_CLOSURE(env->n_captured + n_args - 3));
+        return apply_clos(x, kont, 1, &kont->env.captured[2]);
     } else {
-        ALLOC_CLOS(clos, &ul_S, env->n_captured + n_args);
-        memcpy(&clos->env.captured, env->captured, N_CLOSURE(env->n_captured));
-        memcpy(&clos->env.captured[env->n_captured], args, N_CLOSURE(n_args));
-        return apply_cont(cont, clos);
+        return ul_partial(&ul_S, cont, env, n_args, args);
     }
 }
 
+static ul_closure_t V = {
+    .clos_fn = &ul_V,
+    .env = {
+        .n_captured = 0,
+    },
+};
+
+static void ul_V(ul_closure_t *cont, ul_env_t *env, size_t n_args, ul_closure_t *args[]) {
+    UL_STATS_REDUCE(V);
+    return apply_cont(cont, &V);
+}
+
+static void ul_Dot(ul_closure_t *cont, ul_env_t *env, size_t n_args, ul_closure_t *args[]) {
+    ul_closure_t *self = (ul_closure_t *) ((char *) env - offsetof(ul_closure_t, env));
+    int dumb;
+    ul_task_t *t = ul_task(&dumb);
+    UL_STATS_REDUCE(Dot);
+    t->out[t->n_out++] = (char) (self - ul_dots);
+    if (t->n_out == UL_OUT_SIZE) {
+        ul_yield(t, UL_TASK_OUT);
+    }
+    return ul_pass(cont, n_args, args);
+}
+
+/* A continuation is already a closure in the from space, so c hands it to its
+ * argument wrapped in a Cont and nothing is copied: it lives as long as it is
+ * reachable and moves with everything else on a collection. */
+static void ul_C(ul_closure_t *cont, ul_env_t *env, size_t n_args, ul_closure_t *args[]) {
+    UL_STATS_REDUCE(C);
+    if (n_args > 1) {
+        ALLOC_CONT(kont, &ul_apply_to_cont_fn, n_args);
+        kont->env.captured[0] = cont;
+        memcpy(kont->env.captured + 1, args + 1, N_CLOSURE(n_args - 1));
+        cont = kont;
+    }
+    ALLOC_CLOS(k, &ul_Cont, 1);
+    k->env.captured[0] = cont;
+    return apply_clos(args[0], cont, 1, &k);
+}
+
+static void ul_Cont(ul_closure_t *cont, ul_env_t *env, size_t n_args, ul_closure_t *args[]) {
+    UL_STATS_REDUCE(Cont);
+    return apply_cont(env->captured[0], args[0]);
+}
+
+/* d applied to a value: the promise is the value itself, forced by applying
+ * it. */
+static void ul_D(ul_closure_t *cont, ul_env_t *env, size_t n_args, ul_closure_t *args[]) {
+    assert(env->n_captured < 2);
+    if (env->n_captured + n_args >= 2) {
+        ul_closure_t *x = env->n_captured == 0? args[0] : env->captured[0];
+        UL_STATS_REDUCE(D);
+        return apply_clos(x, cont, env->n_captured + n_args - 1, args + 1 - env->n_captured);
+    } else {
+        return ul_partial(&ul_D, cont, env, n_args, args);
+    }
+}
+
+static void ul_eval_cont_fn(ul_env_t *env, ul_closure_t *clos);
+
+/* d applied to an unevaluated operand: captured[0] is the operand, evaluated
+ * each time the promise is applied. */
+static void ul_Promise(ul_closure_t *cont, ul_env_t *env, size_t n_args, ul_closure_t *args[]) {
+    UL_STATS_REDUCE(Promise);
+    ALLOC_CONT(kont, &ul_apply_to_cont_fn, n_args + 1);
+    kont->env.captured[0] = cont;
+    memcpy(kont->env.captured + 1, args, N_CLOSURE(n_args));
+    ALLOC_CONT(eval, &ul_eval_cont_fn, 2);
+    eval->env.captured[0] = env->captured[0];
+    eval->env.captured[1] = kont;
+    return apply_cont(eval, NULL);
+}
+
 static ul_closure_t I = {
     .clos_fn = &ul_I,
     .env = {
@@ -205,8 +445,91 @@ static ul_closure_t S = {
     }
 };
 
+static ul_closure_t C = {
+    .clos_fn = &ul_C,
+    .env = {
+        .n_captured = 0,
+    }
+};
+
+static ul_closure_t D = {
+    .clos_fn = &ul_D,
+    .env = {
+        .n_captured = 0,
+    }
+};
+
+static ul_closure_t *ul_atom(ul_atom_t atom) {
+    switch (atom) {
+    case UL_S:
+        return &S;
+    case UL_K:
+        return &K;
+    case UL_I:
+        return &I;
+    case UL_V:
+        return &V;
+    case UL_C:
+        return &C;
+    case UL_D:
+        return &D;
+    default:
+        return &ul_dots[(unsigned char) atom];
+    }
+}
+
+/* Evaluation, left to right. The operands still to go are carried as a pair
+ * of pointers into the application node. */
+static void ul_eval_rands(ul_closure_t *f, ul_ast_t **rand, ul_ast_t **end, ul_closure_t *cont);
+
+static void ul_eval(ul_ast_t *ast, ul_closure_t *cont) {
+    if (ul_ast_is_atom(ast)) {
+        return apply_cont(cont, ul_atom(ast->u.atom));
+    }
+    assert(ul_ast_is_atom(ast->u.rator));
+    return ul_eval_rands(ul_atom(ast->u.rator->u.atom), ast->rands, ast->rands + ast->nrands, cont);
+}
+
+static void ul_eval_cont_fn(ul_env_t *env, ul_closure_t *clos) {
+    return ul_eval((ul_ast_t *) env->captured[0], env->captured[1]);
+}
+
+static void ul_eval_rands_cont_fn(ul_env_t *env, ul_closure_t *clos) {
+    return ul_eval_rands(clos, (ul_ast_t **) env->captured[0], (ul_ast_t **) env->captured[1], env->captured[2]);
+}
+
+static void ul_eval_rands(ul_closure_t *f, ul_ast_t **rand, ul_ast_t **end, ul_closure_t *cont) {
+    if (rand == end) {
+        return apply_cont(cont, f);
+    }
+    ALLOC_CONT(kont, &ul_eval_rands_cont_fn, 3);
+    kont->env.captured[0] = AST(rand + 1);
+    kont->env.captured[1] = AST(end);
+    kont->env.captured[2] = cont;
+    if (ul_ast_is_atom(*rand)) {
+        ul_closure_t *x = ul_atom((*rand)->u.atom);
+        return apply_clos(f, kont, 1, &x);
+    } else if (f == &D) {
+        ALLOC_CLOS(promise, &ul_Promise, 1);
+        promise->env.captured[0] = AST(*rand);
+        return apply_cont(kont, promise);
+    } else {
+        ALLOC_CONT(app, &ul_apply_cont_fn, 2);
+        app->env.captured[0] = kont;
+        app->env.captured[1] = f;
+        ALLOC_CONT(eval, &ul_eval_cont_fn, 2);
+        eval->env.captured[0] = AST(*rand);
+        eval->env.captured[1] = app;
+        return apply_cont(eval, NULL);
+    }
+}
+
 static void end_cont_fn(ul_env_t *env_t, ul_closure_t *clos) {
+    int dumb;
+#if DEBUG
     dump_clos(clos);
+#endif
+    ul_yield(ul_task(&dumb), UL_TASK_HALT);
 }
 
 static ul_closure_t end_cont = {
@@ -216,100 +539,380 @@ static ul_closure_t end_cont = {
     },
 };
 
+static void ul_main(ul_closure_t *cont, ul_closure_t *clos) {
+    apply_cont(cont, clos);
+}
+
+static char *ul_read_file(FILE *in) {
+    dynbuf_t buf;
+    char chunk[4096];
+    size_t n;
 
-static void SII_cont_fn(ul_env_t *env_t, ul_closure_t *clos) {
-    ul_closure_t *args[3] = { &I, &I, clos };
-    apply_clos(&S, NULL, 3, args);
+    dynbuf_init(&buf);
+    while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+        if (dynbuf_put(&buf, (uint8_t *) chunk, n) < 0) {
+            goto error;
+        }
+    }
+    if (ferror(in) || dynbuf_put_uint8_t(&buf, 0) < 0) {
+        goto error;
+    }
+    return (char *) buf.data;
+error:
+    dynbuf_free(&buf);
+    return NULL;
 }
 
-static ul_closure_t SII_cont = {
-    .cont_fn = SII_cont_fn,
-    .env = {
-        .n_captured = 0,
+/* Scheduler. A fixed set of workers takes turns at the tasks in the run
+ * queue: each runs a task until it gives way, writes out whatever it printed
+ * and puts it back at the end of the queue unless it is done. */
+static pthread_mutex_t ul_runq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ul_runq_cond = PTHREAD_COND_INITIALIZER;
+static ul_task_t *ul_runq_head, *ul_runq_tail;
+static size_t ul_n_tasks;
+static int ul_status;
+
+static void ul_runq_push(ul_task_t *t) {
+    pthread_mutex_lock(&ul_runq_lock);
+    t->next = NULL;
+    if (ul_runq_tail) {
+        ul_runq_tail->next = t;
+    } else {
+        ul_runq_head = t;
+    }
+    ul_runq_tail = t;
+    pthread_cond_signal(&ul_runq_cond);
+    pthread_mutex_unlock(&ul_runq_lock);
+}
+
+/* NULL once every task is done. */
+static ul_task_t *ul_runq_pop(void) {
+    ul_task_t *t;
+    pthread_mutex_lock(&ul_runq_lock);
+    while (!ul_runq_head && ul_n_tasks) {
+        pthread_cond_wait(&ul_runq_cond, &ul_runq_lock);
+    }
+    if ((t = ul_runq_head) && !(ul_runq_head = t->next)) {
+        ul_runq_tail = NULL;
     }
+    pthread_mutex_unlock(&ul_runq_lock);
+    return t;
+}
+
+static void ul_task_flush(ul_task_t *t) {
+    size_t done = 0;
+    ssize_t n;
+    while (done < t->n_out && (n = write(STDOUT_FILENO, t->out + done, t->n_out - done)) > 0) {
+        done += n;
+    }
+    t->n_out = 0;
+}
+
+static ul_task_t *ul_task_new(const char *name, char *text, ul_ast_t *ast, long fuel) {
+    ul_task_t *t = malloc(sizeof(ul_task_t));
+    if (!t || posix_memalign((void **) &t->stk_from, STK_SIZE, STK_SIZE)
+        || posix_memalign((void **) &t->stk_to, STK_SIZE, STK_SIZE)
+        || !(t->start = malloc(sizeof(ul_closure_t) + N_CLOSURE(2)))) {
+        fputs("ul_rt: out of memory\n", stderr);
+        exit(1);
+    }
+    *(ul_task_t **) t->stk_from = t;
+    *(ul_task_t **) t->stk_to = t;
+    t->fuel = fuel;
+    t->name = name;
+    t->text = text;
+    t->ast = ast;
+    t->n_out = 0;
+#ifdef UL_STATS
+    memset(&t->stats, 0, sizeof(t->stats));
+#endif
+    t->start->cont_fn = &ul_eval_cont_fn;
+    t->start->env.n_captured = 2;
+    t->start->env.captured[0] = AST(ast);
+    t->start->env.captured[1] = &end_cont;
+    getcontext(&t->ctx);
+    t->ctx.uc_stack.ss_sp = t->stk_from;
+    t->ctx.uc_stack.ss_size = STK_SIZE;
+    t->ctx.uc_link = NULL;
+    makecontext(&t->ctx, (void (*)())&ul_main, 2, t->start, NULL);
+    return t;
+}
+
+static void ul_task_free(ul_task_t *t) {
+    free(t->stk_from);
+    free(t->stk_to);
+    free(t->start);
+    ul_ast_free(t->ast);
+    free(t->text);
+    free(t);
+}
+
+#ifdef UL_STATS
+static const char *ul_comb_names[] = {
+#define T(x) #x,
+    UL_RT_COMB_LIST(T)
+#undef T
 };
 
-static void ul_main(ul_closure_t *cont, ul_closure_t *clos) {
-    apply_cont(cont, clos);
+static uint64_t ul_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
+#endif
+
+/* 1 for --stats, 2 for --stats=json */
+static int ul_stats;
+
+static void ul_stats_print(ul_task_t *t) {
+#ifdef UL_STATS
+    ul_stats_t *s = &t->stats;
+    size_t total = s->partial;
 
-int main() {
-    stk_to = mmap(0, STK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-    stk_from = mmap(0, STK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-    assert(stk_to != MAP_FAILED && stk_from != MAP_FAILED);
-    ALLOC_CONT(cont, &resume_application_cont_fn, 4);
-    cont->env.captured[0] = &S,
-    cont->env.captured[1] = &SII_cont,
-    cont->env.captured[2] = &I,
-    cont->env.captured[3] = &I,
-    getcontext(&gc_ctx);
-    gc_ctx.uc_stack.ss_sp = &gc_stk;
-    gc_ctx.uc_stack.ss_size = GC_STK_SIZE;
-    gc_ctx.uc_link = NULL;
-    makecontext(&gc_ctx, (void (*)())&gc_main, 0);
-    getcontext(&ul_ctx);
-    ul_ctx.uc_stack.ss_sp = stk_from;
-    ul_ctx.uc_stack.ss_size = STK_SIZE;
-    ul_ctx.uc_link = NULL;
-    makecontext(&ul_ctx, (void (*)())&ul_main, 2, cont, NULL);
-    setcontext(&ul_ctx);
-    return 0;
-}
-
-static char *allocp;
-static inline ul_force_inline ul_closure_t *copy(ul_closure_t *c) {
+    for (int i = 0; i < UL_RT_N_COMBS; i++) {
+        total += s->reductions[i];
+    }
+    /* one line a task, so tasks finishing on other workers do not mix */
+    flockfile(stderr);
+    if (ul_stats == 2) {
+        fprintf(stderr, "{\"name\": \"%s\", \"reductions\": %zu, \"by_kind\": {", t->name, total);
+        for (int i = 0; i < UL_RT_N_COMBS; i++) {
+            fprintf(stderr, "%s\"%s\": %zu", i ? ", " : "", ul_comb_names[i], s->reductions[i]);
+        }
+        fprintf(stderr, "}, \"partial\": %zu, \"alloc_objects\": %zu, \"alloc_bytes\": %zu, \"gcs\": %zu, "
+                        "\"gc_copied\": %zu, \"gc_ms\": %.3f, \"live_peak\": %zu}\n",
+                s->partial, s->alloc_objects, s->alloc_bytes, s->gcs, s->gc_copied, s->gc_ns / 1e6,
+                s->live_peak);
+    } else {
+        fprintf(stderr, "ul_rt: %s: %zu reductions:", t->name, total);
+        for (int i = 0; i < UL_RT_N_COMBS; i++) {
+            fprintf(stderr, " %s %zu", ul_comb_names[i], s->reductions[i]);
+        }
+        fprintf(stderr, " partial %zu, %zu objects, %zu bytes allocated, %zu collections, "
+                        "%zu bytes copied, %.3f ms, %zu live at most\n",
+                s->partial, s->alloc_objects, s->alloc_bytes, s->gcs, s->gc_copied, s->gc_ns / 1e6,
+                s->live_peak);
+    }
+    funlockfile(stderr);
+#endif
+}
+
+static void ul_task_done(ul_task_t *t) {
+    int status = 0;
+    switch (t->state) {
+    case UL_TASK_FUEL:
+        fprintf(stderr, "ul_rt: %s: out of fuel\n", t->name);
+        status = 2;
+        break;
+    case UL_TASK_OOM:
+        fprintf(stderr, "ul_rt: %s: out of memory\n", t->name);
+        status = 1;
+        break;
+    }
+    if (ul_stats) {
+        ul_stats_print(t);
+    }
+    ul_task_free(t);
+    pthread_mutex_lock(&ul_runq_lock);
+    if (status > ul_status) {
+        ul_status = status;
+    }
+    if (!--ul_n_tasks) {
+        pthread_cond_broadcast(&ul_runq_cond);
+    }
+    pthread_mutex_unlock(&ul_runq_lock);
+}
+
+static void *ul_worker_main(void *arg) {
+    ul_worker_t *w = arg;
+    ul_task_t *t;
+
+    getcontext(&w->gc_ctx);
+    w->gc_ctx.uc_stack.ss_sp = w->gc_stk;
+    w->gc_ctx.uc_stack.ss_size = GC_STK_SIZE;
+    w->gc_ctx.uc_link = NULL;
+    makecontext(&w->gc_ctx, (void (*)())&gc_main, 1, w);
+    while ((t = ul_runq_pop())) {
+        t->worker = w;
+        t->slice = t->fuel - UL_SLICE;
+        w->task = t;
+        swapcontext(&w->sched_ctx, &t->ctx);
+        ul_task_flush(t);
+        if (t->state == UL_TASK_SLICE || t->state == UL_TASK_OUT) {
+            ul_runq_push(t);
+        } else {
+            ul_task_done(t);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    long fuel = LONG_MAX;
+    int n_workers = 1;
+    ul_worker_t *workers;
+    pthread_t *threads;
+    int opt;
+    static const struct option longopts[] = {
+        { "stats", optional_argument, NULL, 'S' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    while ((opt = getopt_long(argc, argv, "f:j:", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'f':
+            if ((fuel = atol(optarg)) <= 0) {
+                goto usage;
+            }
+            break;
+        case 'j':
+            if ((n_workers = atoi(optarg)) <= 0) {
+                goto usage;
+            }
+            break;
+        case 'S':
+            if (optarg && strcmp(optarg, "json")) {
+                goto usage;
+            }
+            ul_stats = optarg ? 2 : 1;
+            break;
+        default:
+            goto usage;
+        }
+    }
+#ifndef UL_STATS
+    if (ul_stats) {
+        fputs("ul_rt: --stats needs a build with -DUL_STATS\n", stderr);
+        return 1;
+    }
+#endif
+    for (int i = 0; i < 256; i++) {
+        ul_dots[i].clos_fn = &ul_Dot;
+    }
+    /* No files is a single program from stdin. */
+    for (int i = optind; i == optind || i < argc; i++) {
+        const char *name = i < argc? argv[i] : "-";
+        FILE *in = stdin;
+        char *text;
+        ul_ast_t *ast;
+
+        if (strcmp(name, "-") && !(in = fopen(name, "r"))) {
+            perror(name);
+            return 1;
+        }
+        text = ul_read_file(in);
+        if (in != stdin) {
+            fclose(in);
+        }
+        if (!text) {
+            fprintf(stderr, "ul_rt: %s: cannot read program\n", name);
+            return 1;
+        }
+        ul_parse_state_t state = {text, UL_PARSE_OK};
+        if (!(ast = ul_parse_prog(&state))) {
+            fprintf(stderr, "ul_rt: %s: parse error %d\n", name, state.error);
+            return 1;
+        }
+        ul_runq_push(ul_task_new(name, text, ast, fuel));
+        ul_n_tasks++;
+    }
+    /* The main thread is the first worker. */
+    workers = malloc(sizeof(ul_worker_t) * n_workers);
+    threads = malloc(sizeof(pthread_t) * n_workers);
+    assert(workers && threads);
+    for (int i = 1; i < n_workers; i++) {
+        if (pthread_create(&threads[i], NULL, &ul_worker_main, &workers[i])) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    ul_worker_main(&workers[0]);
+    for (int i = 1; i < n_workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(workers);
+    return ul_status;
+usage:
+    fprintf(stderr, "usage: %s [-f fuel] [-j workers] [--stats[=json]] [file...]\n", argv[0]);
+    return 1;
+}
+
+static inline ul_force_inline ul_closure_t *copy(ul_worker_t *w, ul_closure_t *c) {
 #define GC_FWDPTR_TAG (-1UL)
+    ul_task_t *t = w->task;
     if (!c) return NULL;
-    if ((uintptr_t) c < (uintptr_t) stk_from) return c;
-    if ((uintptr_t) c > (uintptr_t) stk_from + STK_SIZE) return c;
-    allocp -= sizeof(ul_closure_t) + N_CLOSURE(c->env.n_captured);
+    if ((uintptr_t) c < (uintptr_t) t->stk_from) return c;
+    if ((uintptr_t) c > (uintptr_t) t->stk_from + STK_SIZE) return c;
+    if (c->env.n_captured == GC_FWDPTR_TAG) return c->fwd_ptr;
+    w->allocp -= sizeof(ul_closure_t) + N_CLOSURE(c->env.n_captured);
+    if (w->allocp < t->stk_to + 2 * STK_GC_THRES) {
+        /* The gc context starts over on the next collection anyway. */
+        t->state = UL_TASK_OOM;
+        setcontext(&w->sched_ctx);
+    }
     // memcpy(allocp, c, sizeof(ul_closure_t) + N_CLOSURE(c->env.n_captured));
-    ((ul_closure_t *) allocp)->clos_fn = c->clos_fn;
-    ((ul_closure_t *) allocp)->env.n_captured = c->env.n_captured;
+    ((ul_closure_t *) w->allocp)->clos_fn = c->clos_fn;
+    ((ul_closure_t *) w->allocp)->env.n_captured = c->env.n_captured;
     for (size_t i = 0; i < c->env.n_captured; i++) {
-        ((ul_closure_t *) allocp)->env.captured[i] = c->env.captured[i];
+        ((ul_closure_t *) w->allocp)->env.captured[i] = c->env.captured[i];
     }
-    c->fwd_ptr = (ul_closure_t *) allocp;
+    c->fwd_ptr = (ul_closure_t *) w->allocp;
     c->env.n_captured = GC_FWDPTR_TAG;
     return c->fwd_ptr;
 }
 
+/* Fuel and turns are only looked at here; a task only gives way when
+ * there is someone waiting, and is resumed right where it left, possibly by
+ * another worker. */
 void gc(ul_closure_t *cont, ul_closure_t *clos) {
-    gc_cont = cont;
-    gc_clos = clos;
-    swapcontext(&ul_ctx, &gc_ctx);
-}
-
-void gc_main() {
-    static char *scan_limit, *scanp, *old_allocp;
-    static int need_scan;
-    need_scan = 1;
-    scan_limit = allocp = stk_to + STK_SIZE;
-    gc_cont = copy(gc_cont);
-    gc_clos = copy(gc_clos);
-    while (need_scan) {
-        need_scan = 0;
-        old_allocp = scanp = allocp;
+    int dumb;
+    ul_task_t *t = ul_task(&dumb);
+    if (t->fuel < 0) {
+        ul_yield(t, UL_TASK_FUEL);
+    }
+    if (t->fuel < t->slice && __atomic_load_n(&ul_runq_head, __ATOMIC_RELAXED)) {
+        ul_yield(t, UL_TASK_SLICE);
+    }
+    t->gc_cont = cont;
+    t->gc_clos = clos;
+    swapcontext(&t->ctx, &t->worker->gc_ctx);
+}
+
+void gc_main(ul_worker_t *w) {
+    ul_task_t *t = w->task;
+    char *scan_limit, *scanp, *old_allocp;
+#ifdef UL_STATS
+    uint64_t start = ul_now_ns();
+#endif
+    scan_limit = w->allocp = t->stk_to + STK_SIZE;
+    t->gc_cont = copy(w, t->gc_cont);
+    t->gc_clos = copy(w, t->gc_clos);
+    while (w->allocp != scan_limit) {
+        old_allocp = scanp = w->allocp;
         while (scanp < scan_limit) {
             ul_closure_t *const scanned = (ul_closure_t *)scanp;
             for (size_t i = 0; i < scanned->env.n_captured; i++) {
-                if (scanned->env.captured[i] && scanned->env.captured[i]->env.n_captured == GC_FWDPTR_TAG) {
-                    scanned->env.captured[i] = scanned->env.captured[i]->fwd_ptr;
-                } else {
-                    scanned->env.captured[i] = copy(scanned->env.captured[i]);
-                    need_scan = 1;
-                } 
+                scanned->env.captured[i] = copy(w, scanned->env.captured[i]);
             }
             scanp += sizeof(ul_closure_t) + N_CLOSURE(scanned->env.n_captured);
         }
         scan_limit = old_allocp;
     }
-    ul_ctx.uc_stack.ss_sp = stk_to;
-    ul_ctx.uc_stack.ss_size = allocp - stk_to;
-    char *tmp = stk_to;
-    stk_to = stk_from;
-    stk_from = tmp;
-    makecontext(&ul_ctx, (void (*)())&ul_main, 2, gc_cont, gc_clos);
-    setcontext(&ul_ctx);
+#ifdef UL_STATS
+    t->stats.gcs++;
+    t->stats.gc_copied += t->stk_to + STK_SIZE - w->allocp;
+    if ((size_t) (t->stk_to + STK_SIZE - w->allocp) > t->stats.live_peak) {
+        t->stats.live_peak = t->stk_to + STK_SIZE - w->allocp;
+    }
+    t->stats.gc_ns += ul_now_ns() - start;
+#endif
+    t->ctx.uc_stack.ss_sp = t->stk_to;
+    t->ctx.uc_stack.ss_size = w->allocp - t->stk_to;
+    char *tmp = t->stk_to;
+    t->stk_to = t->stk_from;
+    t->stk_from = tmp;
+    makecontext(&t->ctx, (void (*)())&ul_main, 2, t->gc_cont, t->gc_clos);
+    setcontext(&t->ctx);
 #undef GC_FWDPTR_TAG
 }
@@ -0,0 +1,73 @@
+/* The protocol of the ul server (ul -s).
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 Zeling Feng
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#pragma once
+#include <stdint.h>
+
+/* A connection carries any number of requests, each answered before the
+ * next one is read. Everything is in host byte order.
+ *
+ *   LOAD  len bytes of program text follow the request. Answered with an
+ *         ID reply holding the 8 byte id of the program, or an END reply
+ *         with UL_SERVE_EPARSE.
+ *   RUN   run the program id with fuel applications (0 for no limit).
+ *         Answered with OUT replies holding the output as it is written,
+ *         then an END reply holding the 4 byte status of the run.
+ */
+enum {
+    UL_SERVE_LOAD = 1,
+    UL_SERVE_RUN,
+};
+
+typedef struct {
+    uint32_t op;
+    uint32_t len;
+    uint64_t id;
+    int64_t fuel;
+} ul_serve_req_t;
+
+enum {
+    UL_SERVE_ID = 1,
+    UL_SERVE_OUT,
+    UL_SERVE_END,
+};
+
+/* followed by len bytes */
+typedef struct {
+    uint32_t type;
+    uint32_t len;
+} ul_serve_rep_t;
+
+enum {
+    UL_SERVE_OK,
+    UL_SERVE_FUEL,
+    UL_SERVE_OOM,
+    UL_SERVE_STACK,
+    UL_SERVE_EPARSE,
+    UL_SERVE_ENOPROG, /* no program loaded with that id */
+    UL_SERVE_EPROTO,  /* a request that makes no sense; the server hangs up */
+};
+
+/* The largest program LOAD takes. */
+#define UL_SERVE_MAX_PROG (16 * 1024 * 1024)
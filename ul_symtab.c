@@ -22,71 +22,143 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
  * SOFTWARE.
  */
-#include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "ul_symtab.h"
 
-static size_t djb2(const char *str, size_t nsize);
+#define UL_SYM_ALIGN sizeof(size_t)
+#define UL_SYM_SIZE(nchar)                                                     \
+    ((offsetof(ul_sym_t, data) + (nchar) + UL_SYM_ALIGN) & ~(UL_SYM_ALIGN - 1))
+
+static size_t ul_sym_hash(const char *str, size_t nchar);
 
 ul_sym_t *ul_sym_new(ul_sym_kind kind, const char *str, size_t nchar)
 {
-    ul_sym_t *sym = malloc(sizeof(ul_sym_t) + nchar);
+    ul_sym_t *sym = malloc(UL_SYM_SIZE(nchar));
     if (!sym)
         return NULL;
     sym->kind = kind;
-    list_init(&sym->symtab_link);
-    strncpy(sym->data, str, nchar + 1);
+    sym->nchar = nchar;
+    memcpy(sym->data, str, nchar);
+    sym->data[nchar] = '\0';
     return sym;
 }
 
+/* Only for symbols of ul_sym_new; those of a table go with the table. */
 void ul_sym_free(ul_sym_t *sym)
 {
-    list_unlink(&sym->symtab_link);
     free(sym);
 }
 
 void ul_symtab_init(ul_symtab_t *tbl)
 {
-    int i;
     tbl->nelems = 0;
+    tbl->mask = 0;
+    tbl->slots = NULL;
+    tbl->arena = NULL;
+}
+
+void ul_symtab_destroy(ul_symtab_t *tbl)
+{
+    ul_symtab_chunk_t *chunk, *next;
 
-    for (i = 0; i < UL_SYMTAB_BUCKET_SIZE; i++) {
-        list_init(&tbl->buckets[i]);
+    for (chunk = tbl->arena; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
     }
+    free(tbl->slots);
+    ul_symtab_init(tbl);
 }
 
-void ul_symtab_destroy(ul_symtab_t *tbl)
+static ul_sym_t *ul_symtab_alloc(ul_symtab_t *tbl, size_t nchar)
 {
-    int i;
-    for (i = 0; i < UL_SYMTAB_BUCKET_SIZE; i++) {
-        LIST_FOR_EACH(&tbl->buckets[i], sym, ul_sym_t, symtab_link)
-        {
-            /* lets make ASAN happy */
-#ifdef ASAN
-            ul_sym_t *prev =
-                CONTAINER_OF(sym->symtab_link.prev, ul_sym_t, symtab_link);
-#endif
-            ul_sym_free(sym);
-#ifdef ASAN
-            sym = prev;
-#endif
-            --tbl->nelems;
+    size_t size = UL_SYM_SIZE(nchar);
+    ul_symtab_chunk_t *chunk = tbl->arena;
+    ul_sym_t *sym;
+
+    if (!chunk || chunk->size - chunk->used < size) {
+        chunk = malloc(sizeof(*chunk) +
+                       (size > UL_SYMTAB_ARENA_SIZE ? size : UL_SYMTAB_ARENA_SIZE));
+        if (!chunk)
+            return NULL;
+        chunk->used = 0;
+        chunk->size = size > UL_SYMTAB_ARENA_SIZE ? size : UL_SYMTAB_ARENA_SIZE;
+        /* a symbol too big for a chunk gets one of its own, kept behind the
+         * one being filled */
+        if (size > UL_SYMTAB_ARENA_SIZE && tbl->arena) {
+            chunk->next = tbl->arena->next;
+            tbl->arena->next = chunk;
+        } else {
+            chunk->next = tbl->arena;
+            tbl->arena = chunk;
         }
     }
-    assert(tbl->nelems == 0);
+    sym = (ul_sym_t *)(chunk->data + chunk->used);
+    chunk->used += size;
+    return sym;
 }
 
-static ul_sym_t *ul_symtab_insert(ul_symtab_t *tbl, ul_sym_kind kind,
-                                  const char *str, size_t nchar)
+/* Puts slot where it belongs, moving along any symbol it passes that sits
+ * nearer its home than slot would. */
+static void ul_symtab_place(ul_symtab_t *tbl, ul_symtab_slot_t slot)
 {
-    ul_sym_t *sym = ul_sym_new(kind, str, nchar);
-    if (!sym)
+    size_t i = slot.hash & tbl->mask, dist = 0, d;
+    ul_symtab_slot_t t;
+
+    for (;; i = (i + 1) & tbl->mask, dist++) {
+        if (!tbl->slots[i].hash) {
+            tbl->slots[i] = slot;
+            return;
+        }
+        d = (i - tbl->slots[i].hash) & tbl->mask;
+        if (d < dist) {
+            t = tbl->slots[i];
+            tbl->slots[i] = slot;
+            slot = t;
+            dist = d;
+        }
+    }
+}
+
+static int ul_symtab_grow(ul_symtab_t *tbl)
+{
+    size_t old_n = tbl->slots ? tbl->mask + 1 : 0, i;
+    size_t n = old_n ? 2 * old_n : UL_SYMTAB_MIN_SIZE;
+    ul_symtab_slot_t *old = tbl->slots, *slots = calloc(n, sizeof(*slots));
+
+    if (!slots)
+        return -1;
+    tbl->slots = slots;
+    tbl->mask = n - 1;
+    for (i = 0; i < old_n; i++) {
+        if (old[i].hash)
+            ul_symtab_place(tbl, old[i]);
+    }
+    free(old);
+    return 0;
+}
+
+static ul_sym_t *ul_symtab_insert(ul_symtab_t *tbl, size_t hash,
+                                  ul_sym_kind kind, const char *str,
+                                  size_t nchar)
+{
+    ul_sym_t *sym;
+
+    if (!tbl->slots || (tbl->nelems + 1) * UL_SYMTAB_LOAD_DEN >
+                           (tbl->mask + 1) * UL_SYMTAB_LOAD_NUM) {
+        if (ul_symtab_grow(tbl) < 0)
+            return NULL;
+    }
+    if (!(sym = ul_symtab_alloc(tbl, nchar)))
         return NULL;
+    sym->kind = kind;
+    sym->nchar = nchar;
     /* str is not necessarily a C string, but sym->data is guaranteed to be */
-    list_t *bucket = &tbl->buckets[djb2(str, nchar) & UL_SYMTAB_BUCKET_MASK];
-    list_insert_back(bucket, &sym->symtab_link);
+    memcpy(sym->data, str, nchar);
+    sym->data[nchar] = '\0';
+    ul_symtab_place(tbl, (ul_symtab_slot_t){hash, sym});
     ++tbl->nelems;
     return sym;
 }
@@ -94,23 +166,42 @@ static ul_sym_t *ul_symtab_insert(ul_symtab_t *tbl, ul_sym_kind kind,
 ul_sym_t *ul_symtab_get(ul_symtab_t *tbl, ul_sym_kind kind, const char *str,
                         size_t nchar)
 {
-    list_t *bucket = &tbl->buckets[djb2(str, nchar) & UL_SYMTAB_BUCKET_MASK];
-    LIST_FOR_EACH(bucket, sym, ul_sym_t, symtab_link)
-    {
-        if (strncmp(sym->data, str, nchar) == 0) {
-            return sym;
-        }
+    size_t hash = ul_sym_hash(str, nchar), i, dist;
+    ul_symtab_slot_t *slot;
+
+    /* a symbol nearer its home than the probe is to ours means ours would
+     * have displaced it, so is not in the table */
+    for (i = hash & tbl->mask, dist = 0; tbl->slots;
+         i = (i + 1) & tbl->mask, dist++) {
+        slot = &tbl->slots[i];
+        if (!slot->hash || ((i - slot->hash) & tbl->mask) < dist)
+            break;
+        if (slot->hash == hash && slot->sym->nchar == nchar &&
+            memcmp(slot->sym->data, str, nchar) == 0)
+            return slot->sym;
     }
-    return ul_symtab_insert(tbl, kind, str, nchar);
+    return ul_symtab_insert(tbl, hash, kind, str, nchar);
 }
 
-size_t djb2(const char *str, size_t nsize)
+/* Eight bytes a round, multiplied in, and the result mixed as by the
+ * finalizer of MurmurHash3; never 0, which marks an empty slot. */
+static size_t ul_sym_hash(const char *str, size_t nchar)
 {
-    size_t hash = 5381;
-    int i;
+    uint64_t hash = 0x9e3779b97f4a7c15u ^ nchar, word;
+    size_t i;
 
-    for (i = 0; i < nsize; i++)
-        hash = ((hash << 5u) + hash) + str[i]; /* hash * 33 + c */
-
-    return hash;
+    for (i = 0; i + 8 <= nchar; i += 8) {
+        memcpy(&word, str + i, 8);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdu;
+        hash ^= hash >> 32;
+    }
+    if (i < nchar) {
+        word = 0;
+        memcpy(&word, str + i, nchar - i);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdu;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53u;
+    hash ^= hash >> 33;
+    return (size_t)hash ? (size_t)hash : 1;
 }
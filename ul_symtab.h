@@ -25,10 +25,15 @@
 #pragma once
 #include <stddef.h>
 
-#include "list.h"
-
-#define UL_SYMTAB_BUCKET_SIZE 128
-#define UL_SYMTAB_BUCKET_MASK (UL_SYMTAB_BUCKET_SIZE - 1u)
+/* The table is open addressed with Robin Hood probing: a symbol displaces
+ * any it finds nearer its own home slot, which keeps every probe sequence
+ * short up to a high load. It doubles once past UL_SYMTAB_LOAD_NUM /
+ * UL_SYMTAB_LOAD_DEN full. */
+#define UL_SYMTAB_MIN_SIZE 16
+#define UL_SYMTAB_LOAD_NUM 7
+#define UL_SYMTAB_LOAD_DEN 8
+/* symbols are carved from chunks of this many bytes, or one of their own */
+#define UL_SYMTAB_ARENA_SIZE 65536
 
 typedef enum {
     UL_SYM_S,
@@ -40,14 +45,28 @@ typedef enum {
 } ul_sym_kind;
 
 typedef struct ul_sym {
-    list_link_t symtab_link;
     ul_sym_kind kind;
+    size_t nchar;
     char data[1];
 } ul_sym_t;
 
+typedef struct ul_symtab_slot {
+    size_t hash; /* 0 if the slot is empty */
+    ul_sym_t *sym;
+} ul_symtab_slot_t;
+
+typedef struct ul_symtab_chunk {
+    struct ul_symtab_chunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ul_symtab_chunk_t;
+
 typedef struct ul_symtab {
     size_t nelems;
-    list_t buckets[UL_SYMTAB_BUCKET_SIZE];
+    size_t mask; /* of the slots, one less than their number, or 0 */
+    ul_symtab_slot_t *slots;
+    ul_symtab_chunk_t *arena;
 } ul_symtab_t;
 
 ul_sym_t *ul_sym_new(ul_sym_kind kind, const char *str, size_t nchar);
@@ -0,0 +1,108 @@
+/* Reads back the reduction trace written by ul --trace.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 Zeling Feng
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ul_trace.h"
+
+/* Prints a line for each record,
+ *
+ *   n pc kind arity nargs gc alloc
+ *
+ * or with -s the applications of each kind of closure, and how many of
+ * them were partial, that is to fewer arguments than it still took. */
+static void ul_trace_summary(const ul_trace_hdr_t *hdr, const ul_trace_rec_t *recs, uint64_t n) {
+    uint64_t all[UL_TRACE_KINDS] = { 0 }, partial[UL_TRACE_KINDS] = { 0 };
+
+    for (uint64_t i = 0; i < n; i++) {
+        all[recs[i].kind % UL_TRACE_KINDS]++;
+        partial[recs[i].kind % UL_TRACE_KINDS] += recs[i].nargs < recs[i].arity;
+    }
+    printf("%llu applications\n", (unsigned long long) n);
+    for (int k = 0; k < UL_TRACE_KINDS; k++) {
+        if (all[k]) {
+            printf("%-*.*s %llu, %llu partial\n", UL_TRACE_NAME, UL_TRACE_NAME, hdr->kinds[k],
+                   (unsigned long long) all[k], (unsigned long long) partial[k]);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const ul_trace_hdr_t *hdr;
+    const ul_trace_rec_t *recs;
+    struct stat st;
+    uint64_t n;
+    int summary = 0, fd, opt;
+    void *p;
+
+    while ((opt = getopt(argc, argv, "s")) != -1) {
+        switch (opt) {
+        case 's':
+            summary = 1;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (argc - optind != 1) {
+        goto usage;
+    }
+    if ((fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (st.st_size < UL_TRACE_HDR_SIZE ||
+        (p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "%s: not a trace\n", argv[optind]);
+        return 1;
+    }
+    hdr = p;
+    recs = (const ul_trace_rec_t *) ((const char *) p + UL_TRACE_HDR_SIZE);
+    if (memcmp(hdr->magic, UL_TRACE_MAGIC, sizeof(hdr->magic)) || hdr->version != UL_TRACE_VERSION ||
+        hdr->rec_size != sizeof(ul_trace_rec_t)) {
+        fprintf(stderr, "%s: not a trace, or of another version\n", argv[optind]);
+        return 1;
+    }
+    n = (st.st_size - UL_TRACE_HDR_SIZE) / sizeof(ul_trace_rec_t);
+    if (summary) {
+        ul_trace_summary(hdr, recs, n);
+        return 0;
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        printf("%llu %u %.*s %u %u %u %llu\n", (unsigned long long) i, recs[i].pc, UL_TRACE_NAME,
+               hdr->kinds[recs[i].kind % UL_TRACE_KINDS], recs[i].arity, recs[i].nargs, recs[i].gc,
+               (unsigned long long) recs[i].alloc);
+    }
+    return 0;
+usage:
+    fprintf(stderr, "usage: %s [-s] trace\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,52 @@
+/* The reduction trace written by ul --trace.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 Zeling Feng
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#pragma once
+#include <stdint.h>
+
+/* A header of UL_TRACE_HDR_SIZE bytes, then a record for every application
+ * in the order they were made, up to the end of the file. The kinds of
+ * closure are named in the header, so the trace can be read without the
+ * interpreter that wrote it. Everything is in host byte order. */
+#define UL_TRACE_MAGIC "ultrace"
+#define UL_TRACE_VERSION 1
+#define UL_TRACE_HDR_SIZE 4096
+#define UL_TRACE_KINDS 32
+#define UL_TRACE_NAME 16
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t rec_size;
+    char kinds[UL_TRACE_KINDS][UL_TRACE_NAME];
+} ul_trace_hdr_t;
+
+typedef struct {
+    uint32_t pc;        /* offset of the last instruction run */
+    uint8_t kind;       /* of the closure applied */
+    uint8_t arity;      /* arguments it still took */
+    uint8_t nargs;      /* it was applied to, 255 for any more */
+    uint8_t gc;         /* collections so far, modulo 256 */
+    uint64_t alloc;     /* the allocation pointer, as bytes into from-space */
+} ul_trace_rec_t;